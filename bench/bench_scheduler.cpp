@@ -0,0 +1,93 @@
+#include "src/scheduler.h"
+#include "src/log.h"
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+
+using namespace eva01;
+
+static Logger::ptr g_logger = EVA_ROOT_LOGGER();
+
+// Tasks per second through Scheduler::schedule(), for function tasks
+// scheduled from outside and from a worker, and for fibers rescheduled
+// when they yield.
+
+constexpr const int FUNC_TASKS = 200000;
+constexpr const int FIBERS = 100;
+constexpr const int FIBER_YIELDS = 1000;
+
+static void report(const char* name, int tasks, std::chrono::steady_clock::duration elapsed) {
+    double secs = std::chrono::duration<double>(elapsed).count();
+    std::cout << name << ": " << tasks << " tasks in " << secs << "s, "
+              << (uint64_t)(tasks / secs) << " tasks/s" << std::endl;
+}
+
+// A capture larger than the small buffer of std::function.
+struct Payload {
+    std::atomic<int>* done;
+    void* a;
+    void* b;
+    void* c;
+};
+
+static void bench_func_outside(int threads) {
+    Scheduler sc(threads, "bench");
+    sc.start();
+    std::atomic<int> done { 0 };
+    Payload p { &done, nullptr, nullptr, nullptr };
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < FUNC_TASKS; ++i) {
+        sc.schedule([p]() { ++*p.done; });
+    }
+    sc.stop();
+    report("schedule(func) outside", done, std::chrono::steady_clock::now() - start);
+}
+
+static void bench_func_worker(int threads) {
+    Scheduler sc(threads, "bench");
+    sc.start();
+    std::atomic<int> done { 0 };
+    Payload p { &done, nullptr, nullptr, nullptr };
+
+    auto start = std::chrono::steady_clock::now();
+    sc.schedule([&sc, p]() {
+        for (int i = 0; i < FUNC_TASKS; ++i) {
+            sc.schedule([p]() { ++*p.done; });
+        }
+    });
+    sc.stop();
+    report("schedule(func) worker", done, std::chrono::steady_clock::now() - start);
+}
+
+static void bench_fiber(int threads) {
+    Scheduler sc(threads, "bench");
+    sc.start();
+    std::atomic<int> done { 0 };
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < FIBERS; ++i) {
+        sc.schedule([&done]() {
+            // every yield puts the fiber back through schedule(fiber)
+            for (int j = 0; j < FIBER_YIELDS; ++j) {
+                Fiber::YieldReady();
+                ++done;
+            }
+        });
+    }
+    sc.stop();
+    report("schedule(fiber)", done, std::chrono::steady_clock::now() - start);
+}
+
+int main(int argc, char** argv) {
+    g_logger->setLevel(LogLevel::INFO);
+    EVA_LOGGER("system")->setLevel(LogLevel::INFO);
+    int threads = argc > 1 ? atoi(argv[1]) : 4;
+    std::cout << "threads: " << threads << std::endl;
+
+    bench_func_outside(threads);
+    bench_func_worker(threads);
+    bench_fiber(threads);
+    return 0;
+}
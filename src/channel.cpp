@@ -0,0 +1,174 @@
+#include "src/channel.h"
+#include "src/macro.h"
+#include <algorithm>
+
+namespace eva01 {
+
+void ChannelWaitList::push(ChannelWaiter* waiter) {
+    ASSERT(!waiter->linked);
+    waiter->prev = m_tail;
+    waiter->next = nullptr;
+    if (m_tail) {
+        m_tail->next = waiter;
+    } else {
+        m_head = waiter;
+    }
+    m_tail = waiter;
+    waiter->linked = true;
+}
+
+void ChannelWaitList::remove(ChannelWaiter* waiter) {
+    ASSERT(waiter->linked);
+    if (waiter->prev) {
+        waiter->prev->next = waiter->next;
+    } else {
+        m_head = waiter->next;
+    }
+    if (waiter->next) {
+        waiter->next->prev = waiter->prev;
+    } else {
+        m_tail = waiter->prev;
+    }
+    waiter->prev = waiter->next = nullptr;
+    waiter->linked = false;
+}
+
+ChannelWaiter* ChannelWaitList::claim() {
+    while (m_head) {
+        ChannelWaiter* waiter = m_head;
+        remove(waiter);
+        if (waiter->parker->claim(waiter->index)) {
+            return waiter;
+        }
+    }
+    return nullptr;
+}
+
+void ChannelBase::close() {
+    MutexGuard<Mutex> lk(m_mutex);
+    if (m_closed) {
+        return;
+    }
+    m_closed = true;
+
+    // Buffered values stay readable. Whoever waits now never completes.
+    while (ChannelWaiter* waiter = m_receivers.claim()) {
+        *waiter->ok = false;
+        Wake(waiter);
+    }
+    while (ChannelWaiter* waiter = m_senders.claim()) {
+        *waiter->ok = false;
+        Wake(waiter);
+    }
+}
+
+bool ChannelBase::isClosed() {
+    MutexGuard<Mutex> lk(m_mutex);
+    return m_closed;
+}
+
+bool ChannelBase::wait(ChannelWaitList& list, void* value, bool* ok, uint64_t timeout_ms) {
+    // The other side writes to the waiter while we are parked, see
+    // ChannelWaiter.
+    ChannelWaiter local;
+    std::unique_ptr<ChannelWaiter> heap;
+    ChannelWaiter* waiter = &local;
+    if (Fiber::OnSharedStack()) {
+        heap.reset(new ChannelWaiter);
+        waiter = heap.get();
+    }
+    waiter->parker = std::make_shared<FiberParker>();
+    waiter->value = value;
+    waiter->ok = heap ? &waiter->ok_value : ok;
+    list.push(waiter);
+
+    m_mutex.unlock();
+    waiter->parker->park(timeout_ms);
+    m_mutex.lock();
+
+    if (waiter->linked) {
+        list.remove(waiter);
+    }
+    if (heap) {
+        *ok = waiter->ok_value;
+    }
+    return waiter->parker->getToken() != PARK_TIMED_OUT;
+}
+
+void ChannelBase::Wake(ChannelWaiter* waiter) {
+    FiberParker::ptr parker = waiter->parker;
+    parker->unpark();
+}
+
+int Select::wait(uint64_t timeout_ms) {
+    // Lock every channel once, in address order, so that selects over the
+    // same channels cannot deadlock.
+    std::vector<ChannelBase*> channels;
+    channels.reserve(m_cases.size());
+    for (auto& c : m_cases) {
+        channels.push_back(c->channel);
+    }
+    std::sort(channels.begin(), channels.end());
+    channels.erase(std::unique(channels.begin(), channels.end()), channels.end());
+
+    for (auto ch : channels) {
+        ch->m_mutex.lock();
+    }
+
+    int index = PARK_TIMED_OUT;
+    for (size_t i = 0; i < m_cases.size(); ++i) {
+        if (m_cases[i]->tryComplete()) {
+            index = i;
+            break;
+        }
+    }
+
+    if (index == PARK_TIMED_OUT && timeout_ms) {
+        // Park on all channels at once. The first counterpart or the
+        // timeout claims the parker, the other waiters become stale.
+        // The waiters and the cases are on the heap already, only values
+        // received into the stack of a shared stack fiber need a copy.
+        bool shared = Fiber::OnSharedStack();
+        FiberParker::ptr parker = std::make_shared<FiberParker>();
+        std::vector<ChannelWaiter> waiters(m_cases.size());
+        for (size_t i = 0; i < m_cases.size(); ++i) {
+            if (shared) {
+                m_cases[i]->box();
+            }
+            waiters[i].parker = parker;
+            waiters[i].index = i;
+            waiters[i].value = m_cases[i]->getValue();
+            waiters[i].ok = &m_cases[i]->ok;
+            m_cases[i]->getWaitList().push(&waiters[i]);
+        }
+        for (auto it = channels.rbegin(); it != channels.rend(); ++it) {
+            (*it)->m_mutex.unlock();
+        }
+
+        parker->park(timeout_ms);
+
+        for (auto ch : channels) {
+            ch->m_mutex.lock();
+        }
+        for (size_t i = 0; i < m_cases.size(); ++i) {
+            if (waiters[i].linked) {
+                m_cases[i]->getWaitList().remove(&waiters[i]);
+            }
+            if (shared) {
+                m_cases[i]->unbox();
+            }
+        }
+        index = parker->getToken();
+    }
+
+    for (auto it = channels.rbegin(); it != channels.rend(); ++it) {
+        (*it)->m_mutex.unlock();
+    }
+
+    if (index != PARK_TIMED_OUT && m_cases[index]->result) {
+        *m_cases[index]->result = m_cases[index]->ok;
+    }
+    return index;
+}
+
+}
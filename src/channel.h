@@ -0,0 +1,260 @@
+#pragma once
+
+#include "src/fiber_sync.h"
+#include "src/mutex.h"
+#include "src/noncopyable.h"
+#include <deque>
+#include <memory>
+#include <vector>
+
+namespace eva01 {
+
+// Capacity of a channel whose sends never wait.
+constexpr const size_t CHANNEL_UNBOUNDED = ~(size_t)0;
+
+// A send or receive parked on one channel. It lives on the stack of the
+// parked caller and is linked while the caller waits; a shared stack fiber
+// keeps it and what it points to on the heap, see Fiber::OnSharedStack().
+struct ChannelWaiter {
+    FiberParker::ptr parker;
+    int index = 0;          // token the parker is claimed with
+    void* value = nullptr;  // T* to move from (send) or into (receive)
+    bool* ok = nullptr;     // set by whoever completes the operation
+    bool ok_value = false;  // what ok points to for a waiter on the heap
+    bool linked = false;
+    ChannelWaiter* prev = nullptr;
+    ChannelWaiter* next = nullptr;
+};
+
+class ChannelWaitList {
+public:
+    void push(ChannelWaiter* waiter);
+    void remove(ChannelWaiter* waiter);
+    // Unlink waiters from the front until one can be claimed for us.
+    // Waiters already claimed elsewhere (another select case, a timeout)
+    // are dropped on the way. nullptr if there is none.
+    ChannelWaiter* claim();
+    bool empty() const { return !m_head; }
+
+private:
+    ChannelWaiter* m_head = nullptr;
+    ChannelWaiter* m_tail = nullptr;
+};
+
+// Untyped part of Channel<T>, what Select needs to lock and park on it.
+class ChannelBase : public NonCopyable {
+    friend class Select;
+
+public:
+    void close();
+    bool isClosed();
+
+protected:
+    // Park the caller on list as a waiter for value. m_mutex is held on
+    // entry and on return. false if timeout_ms passed first.
+    bool wait(ChannelWaitList& list, void* value, bool* ok, uint64_t timeout_ms);
+    // Wake a claimed waiter. It may return before this does.
+    static void Wake(ChannelWaiter* waiter);
+
+protected:
+    Mutex m_mutex;
+    bool m_closed = false;
+    ChannelWaitList m_senders;
+    ChannelWaitList m_receivers;
+};
+
+// Multi-producer multi-consumer queue between fibers, threads or both.
+// Capacity 0 makes every send wait for a receiver, CHANNEL_UNBOUNDED makes
+// sends never wait. A caller that has to wait is parked like in
+// fiber_sync.h. Timeouts of fibers run on the timers of their scheduler.
+template <typename T>
+class Channel : public ChannelBase {
+    friend class Select;
+
+public:
+    using ptr = std::shared_ptr<Channel>;
+
+    Channel(size_t capacity = 0)
+        : m_capacity(capacity) {
+    }
+
+    // false if the channel is closed or timeout_ms passed.
+    bool send(T value, uint64_t timeout_ms = ~0ull) {
+        MutexGuard<Mutex> lk(m_mutex);
+        bool ok = false;
+        if (sendLocked(value, ok)) {
+            return ok;
+        }
+        return timeout_ms && park(m_senders, value, ok, timeout_ms) && ok;
+    }
+
+    // false if the channel is closed and drained or timeout_ms passed.
+    bool recv(T& value, uint64_t timeout_ms = ~0ull) {
+        MutexGuard<Mutex> lk(m_mutex);
+        bool ok = false;
+        if (recvLocked(value, ok)) {
+            return ok;
+        }
+        return timeout_ms && park(m_receivers, value, ok, timeout_ms) && ok;
+    }
+
+    bool trySend(T value) { return send(std::move(value), 0); }
+    bool tryRecv(T& value) { return recv(value, 0); }
+
+    size_t getCapacity() const { return m_capacity; }
+    size_t size() {
+        MutexGuard<Mutex> lk(m_mutex);
+        return m_buffer.size();
+    }
+
+private:
+    // wait() for value. The other side moves value while we are parked, a
+    // shared stack fiber has it moved to a copy on the heap.
+    bool park(ChannelWaitList& list, T& value, bool& ok, uint64_t timeout_ms) {
+        if (!Fiber::OnSharedStack()) {
+            return wait(list, &value, &ok, timeout_ms);
+        }
+        std::unique_ptr<T> box(new T(std::move(value)));
+        bool woken = wait(list, box.get(), &ok, timeout_ms);
+        value = std::move(*box);
+        return woken;
+    }
+
+    // Complete a send without waiting if possible. m_mutex is held.
+    bool sendLocked(T& value, bool& ok) {
+        if (m_closed) {
+            ok = false;
+            return true;
+        }
+        if (ChannelWaiter* waiter = m_receivers.claim()) {
+            // a waiting receiver means the buffer is empty
+            *(T*)waiter->value = std::move(value);
+            *waiter->ok = true;
+            Wake(waiter);
+        } else if (m_buffer.size() < m_capacity) {
+            m_buffer.push_back(std::move(value));
+        } else {
+            return false;
+        }
+        ok = true;
+        return true;
+    }
+
+    // Complete a receive without waiting if possible. m_mutex is held.
+    bool recvLocked(T& value, bool& ok) {
+        if (!m_buffer.empty()) {
+            value = std::move(m_buffer.front());
+            m_buffer.pop_front();
+            // a waiting sender means the buffer was full
+            if (ChannelWaiter* waiter = m_senders.claim()) {
+                m_buffer.push_back(std::move(*(T*)waiter->value));
+                *waiter->ok = true;
+                Wake(waiter);
+            }
+        } else if (ChannelWaiter* waiter = m_senders.claim()) {
+            value = std::move(*(T*)waiter->value);
+            *waiter->ok = true;
+            Wake(waiter);
+        } else if (m_closed) {
+            ok = false;
+            return true;
+        } else {
+            return false;
+        }
+        ok = true;
+        return true;
+    }
+
+private:
+    size_t m_capacity;
+    std::deque<T> m_buffer;
+};
+
+// Wait on several channel operations at once, the first one that can
+// complete is done and the others are not.
+//
+//     Select sel;
+//     sel.recv(requests, req);
+//     sel.send(results, res);
+//     switch (sel.wait(100)) { case 0: ...; case 1: ...; default: timeout }
+class Select : public NonCopyable {
+public:
+    // ok tells whether a value was received, false if the channel is closed.
+    template <typename T>
+    Select& recv(Channel<T>& channel, T& value, bool* ok = nullptr) {
+        m_cases.emplace_back(new RecvCase<T>(channel, value, ok));
+        return *this;
+    }
+
+    // ok is false if the channel was closed instead.
+    template <typename T>
+    Select& send(Channel<T>& channel, T value, bool* ok = nullptr) {
+        m_cases.emplace_back(new SendCase<T>(channel, std::move(value), ok));
+        return *this;
+    }
+
+    // Index of the completed case in the order they were added, or
+    // PARK_TIMED_OUT when timeout_ms passed first. With timeout_ms 0 this
+    // only completes a case that is ready.
+    int wait(uint64_t timeout_ms = ~0ull);
+    int tryWait() { return wait(0); }
+
+private:
+    struct Case {
+        Case(ChannelBase& ch, bool* user_ok)
+            : channel(&ch), result(user_ok) {
+        }
+        virtual ~Case() {}
+        // Complete without waiting if possible. The channel mutex is held.
+        virtual bool tryComplete() = 0;
+        virtual ChannelWaitList& getWaitList() = 0;
+        virtual void* getValue() = 0;
+        // Around parking a shared stack fiber: a value of the caller is
+        // not in place meanwhile, receive into a copy on the heap.
+        virtual void box() {}
+        virtual void unbox() {}
+
+        ChannelBase* channel;
+        bool ok = false;
+        bool* result;
+    };
+
+    template <typename T>
+    struct RecvCase : Case {
+        RecvCase(Channel<T>& ch, T& val, bool* user_ok)
+            : Case(ch, user_ok), value(&val) {
+        }
+        bool tryComplete() override {
+            return ((Channel<T>*)channel)->recvLocked(*value, ok);
+        }
+        ChannelWaitList& getWaitList() override { return channel->m_receivers; }
+        void* getValue() override { return boxed ? boxed.get() : value; }
+        void box() override { boxed.reset(new T(std::move(*value))); }
+        void unbox() override {
+            *value = std::move(*boxed);
+            boxed.reset();
+        }
+
+        T* value;
+        std::unique_ptr<T> boxed;
+    };
+
+    template <typename T>
+    struct SendCase : Case {
+        SendCase(Channel<T>& ch, T&& val, bool* user_ok)
+            : Case(ch, user_ok), value(std::move(val)) {
+        }
+        bool tryComplete() override {
+            return ((Channel<T>*)channel)->sendLocked(value, ok);
+        }
+        ChannelWaitList& getWaitList() override { return channel->m_senders; }
+        void* getValue() override { return &value; }
+
+        T value;
+    };
+
+private:
+    std::vector<std::unique_ptr<Case>> m_cases;
+};
+
+}
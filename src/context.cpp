@@ -0,0 +1,204 @@
+#include "context.h"
+#include "macro.h"
+
+#include <cstdint>
+
+#ifndef EVA01_USE_UCONTEXT
+extern "C" {
+// Pushes the callee-saved registers on the current stack, stores the stack
+// pointer into *from_sp, then pops the registers saved on to_sp and returns
+// into that context.
+void eva01_context_swap(void** from_sp, void* to_sp);
+// First return address of a fresh context: calls the function left in a
+// callee-saved register by MakeContext.
+void eva01_context_entry();
+}
+#endif
+
+#if !defined(EVA01_USE_UCONTEXT) && defined(__x86_64__)
+
+asm(R"(
+    .text
+    .globl eva01_context_swap
+    .hidden eva01_context_swap
+    .type eva01_context_swap, @function
+    .align 16
+eva01_context_swap:
+    pushq %rbp
+    pushq %rbx
+    pushq %r12
+    pushq %r13
+    pushq %r14
+    pushq %r15
+    subq $8, %rsp
+    stmxcsr (%rsp)
+    fnstcw 4(%rsp)
+    movq %rsp, (%rdi)
+    movq %rsi, %rsp
+    ldmxcsr (%rsp)
+    fldcw 4(%rsp)
+    addq $8, %rsp
+    popq %r15
+    popq %r14
+    popq %r13
+    popq %r12
+    popq %rbx
+    popq %rbp
+    ret
+    .size eva01_context_swap, .-eva01_context_swap
+
+    .globl eva01_context_entry
+    .hidden eva01_context_entry
+    .type eva01_context_entry, @function
+    .align 16
+eva01_context_entry:
+    .cfi_startproc
+    .cfi_undefined rip
+    callq *%rbx
+    ud2
+    .cfi_endproc
+    .size eva01_context_entry, .-eva01_context_entry
+)");
+
+#elif !defined(EVA01_USE_UCONTEXT) && defined(__aarch64__)
+
+asm(R"(
+    .text
+    .globl eva01_context_swap
+    .hidden eva01_context_swap
+    .type eva01_context_swap, %function
+    .align 4
+eva01_context_swap:
+    sub sp, sp, #0xa0
+    stp d8, d9, [sp, #0x00]
+    stp d10, d11, [sp, #0x10]
+    stp d12, d13, [sp, #0x20]
+    stp d14, d15, [sp, #0x30]
+    stp x19, x20, [sp, #0x40]
+    stp x21, x22, [sp, #0x50]
+    stp x23, x24, [sp, #0x60]
+    stp x25, x26, [sp, #0x70]
+    stp x27, x28, [sp, #0x80]
+    stp x29, x30, [sp, #0x90]
+    mov x9, sp
+    str x9, [x0]
+    mov sp, x1
+    ldp d8, d9, [sp, #0x00]
+    ldp d10, d11, [sp, #0x10]
+    ldp d12, d13, [sp, #0x20]
+    ldp d14, d15, [sp, #0x30]
+    ldp x19, x20, [sp, #0x40]
+    ldp x21, x22, [sp, #0x50]
+    ldp x23, x24, [sp, #0x60]
+    ldp x25, x26, [sp, #0x70]
+    ldp x27, x28, [sp, #0x80]
+    ldp x29, x30, [sp, #0x90]
+    add sp, sp, #0xa0
+    ret
+    .size eva01_context_swap, .-eva01_context_swap
+
+    .globl eva01_context_entry
+    .hidden eva01_context_entry
+    .type eva01_context_entry, %function
+    .align 4
+eva01_context_entry:
+    .cfi_startproc
+    .cfi_undefined x30
+    blr x19
+    brk #0
+    .cfi_endproc
+    .size eva01_context_entry, .-eva01_context_entry
+)");
+
+#endif
+
+namespace eva01 {
+
+#ifdef EVA01_USE_UCONTEXT
+
+void MakeContext(Context* ctx, void* stack, size_t size, ContextFunc func) {
+    if (getcontext(&ctx->ctx)) {
+        ASSERT(false);
+    }
+
+    //!!Important: do not set resume link. We may switch thread. The context may not exist
+    ctx->ctx.uc_link = nullptr;
+    ctx->ctx.uc_stack.ss_sp = stack;
+    ctx->ctx.uc_stack.ss_size = size;
+
+    makecontext(&ctx->ctx, func, 0);
+}
+
+void SwapContext(Context* from, Context* to) {
+    if (swapcontext(&from->ctx, &to->ctx)) {
+        ASSERT(false);
+    }
+}
+
+void* GetContextStackPointer(const Context* ctx) {
+#if defined(__x86_64__)
+    return (void*)ctx->ctx.uc_mcontext.gregs[REG_RSP];
+#elif defined(__aarch64__)
+    return (void*)ctx->ctx.uc_mcontext.sp;
+#else
+    ASSERT(false);
+    return nullptr;
+#endif
+}
+
+const char* GetContextBackend() {
+    return "ucontext";
+}
+
+#else
+
+void MakeContext(Context* ctx, void* stack, size_t size, ContextFunc func) {
+    uintptr_t top = ((uintptr_t)stack + size) & ~(uintptr_t)15;
+    void** sp = (void**)top;
+
+#if defined(__x86_64__)
+    // Frame popped by the first eva01_context_swap into this context, from
+    // the top: return address, rbp, rbx, r12-r15, mxcsr and x87 control word.
+    // Returning into the entry leaves rsp 16-byte aligned for its call.
+    *--sp = (void*)&eva01_context_entry;
+    *--sp = nullptr;        // rbp
+    *--sp = (void*)func;    // rbx
+    *--sp = nullptr;        // r12
+    *--sp = nullptr;        // r13
+    *--sp = nullptr;        // r14
+    *--sp = nullptr;        // r15
+    --sp;
+    ((uint32_t*)sp)[0] = 0x1F80;   // default mxcsr
+    ((uint32_t*)sp)[1] = 0x037F;   // default x87 control word
+#elif defined(__aarch64__)
+    // d8-d15, x19-x28, x29 and x30 as laid out by eva01_context_swap.
+    sp -= 20;
+    for (int i = 0; i < 20; ++i) {
+        sp[i] = nullptr;
+    }
+    sp[8] = (void*)func;                    // x19
+    sp[19] = (void*)&eva01_context_entry;   // x30
+#endif
+
+    ctx->sp = sp;
+}
+
+void SwapContext(Context* from, Context* to) {
+    eva01_context_swap(&from->sp, to->sp);
+}
+
+void* GetContextStackPointer(const Context* ctx) {
+    return ctx->sp;
+}
+
+const char* GetContextBackend() {
+#if defined(__x86_64__)
+    return "asm-x86_64";
+#else
+    return "asm-aarch64";
+#endif
+}
+
+#endif
+
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstddef>
+
+// The context switch backend is chosen at build time. The default is a
+// hand-written switch that only saves callee-saved registers; ucontext is
+// used when EVA01_USE_UCONTEXT is defined or the architecture has no
+// assembly backend.
+#if !defined(EVA01_USE_UCONTEXT) && !defined(__x86_64__) && !defined(__aarch64__)
+#define EVA01_USE_UCONTEXT
+#endif
+
+#ifdef EVA01_USE_UCONTEXT
+#include <ucontext.h>
+#endif
+
+namespace eva01 {
+
+using ContextFunc = void (*)();
+
+struct Context {
+#ifdef EVA01_USE_UCONTEXT
+    ucontext_t ctx;
+#else
+    void* sp = nullptr;
+#endif
+};
+
+// Prepare ctx so that switching into it runs func on the given stack.
+// func must never return.
+void MakeContext(Context* ctx, void* stack, size_t size, ContextFunc func);
+
+// Save the current execution into from and resume to.
+void SwapContext(Context* from, Context* to);
+
+// Stack pointer saved in a context that was switched out of.
+void* GetContextStackPointer(const Context* ctx);
+
+const char* GetContextBackend();
+
+}
@@ -1,8 +1,11 @@
 #include "fiber.h"
 #include "macro.h"
 #include "log.h"
-#include <ucontext.h>
+#include "stack_allocator.h"
+#include "mutex.h"
 #include <atomic>
+#include <stdlib.h>
+#include <string.h>
 
 namespace eva01 {
 
@@ -12,27 +15,82 @@ static std::atomic<uint64_t> s_fiber_count { 0 };
 static thread_local Fiber* t_fiber = nullptr;
 static thread_local Fiber::ptr t_main_fiber = nullptr;
 
+// Hand-over state between call() and TransferTo().
+static thread_local Fiber* t_back = nullptr;          // fiber that last switched to the main fiber
+static thread_local Fiber::ptr t_next = nullptr;      // fiber the main fiber should switch to next
+static thread_local Fiber::ptr t_returned = nullptr;  // see TakeReturned()
+static thread_local Mutex* t_unlock = nullptr;        // see YieldUnlock()
+static thread_local std::atomic<int>* t_yield_request = nullptr; // see MaybeYield()
+
 static Logger::ptr g_logger = EVA_LOGGER("system");
 
-Fiber::Fiber(std::function<void()> func, bool is_main):
+static std::atomic<size_t> s_max_stack_used { 0 };
+
+#ifdef EVA01_STACK_WATERMARK
+// Stacks are filled with a known pattern before the fiber starts. The first
+// overwritten byte from the bottom marks the deepest point the fiber reached.
+constexpr const unsigned char STACK_PAINT = 0xA5;
+
+static void PaintStack(void* stack, size_t size) {
+    memset(stack, STACK_PAINT, size);
+}
+
+static size_t MeasureStack(const void* stack, size_t size) {
+    const unsigned char* p = (const unsigned char*)stack;
+    size_t i = 0;
+    while (i < size && p[i] == STACK_PAINT) {
+        ++i;
+    }
+    return size - i;
+}
+#endif
+
+// Execution stack of all shared stack fibers running on this thread.
+struct SharedStack {
+    ~SharedStack() {
+        if (stack) {
+            StackAllocator::Dealloc(stack, SHARED_STACK_SIZE);
+        }
+    }
+
+    void* get() {
+        if (!stack) {
+            stack = StackAllocator::Alloc(SHARED_STACK_SIZE);
+        }
+        return stack;
+    }
+
+    void* stack = nullptr;
+    // Fibers bound to the thread and not done, see Fiber::GetBoundCount().
+    // Shared with them, as they may go away after the thread.
+    std::shared_ptr<std::atomic<size_t>> bound = std::make_shared<std::atomic<size_t>>(0);
+};
+
+static thread_local SharedStack t_shared_stack;
+
+Fiber::Fiber(InlineFunction func, size_t stacksize, bool shared_stack):
     m_id(++s_fiber_id),
-    m_func(func),
-    m_main(is_main) {
+    m_func(std::move(func)),
+    m_main(false) {
 
     ASSERT(t_main_fiber);
 
     ++s_fiber_count;
 
-    if(getcontext(&m_ctx)) {
-        ASSERT(false);
+    if (shared_stack) {
+        // The context is made on the first call(), once the thread is known.
+        m_shared = true;
+        m_need_make = true;
+        EVA_LOG_DEBUG(g_logger) << "Fiber() shared stack id: " << m_id;
+        return;
     }
 
-    //!!Important: do not set resume link. We may switch thread. The context may not exist
-    m_ctx.uc_link = nullptr; 
-    m_ctx.uc_stack.ss_sp = m_stack;
-    m_ctx.uc_stack.ss_size = sizeof(m_stack);
-
-    makecontext(&m_ctx, &Fiber::MainFunc, 0);
+    m_stacksize = StackAllocator::RoundUp(stacksize ? stacksize : DEFAULT_STACK_SIZE);
+    m_stack = StackAllocator::Alloc(m_stacksize);
+#ifdef EVA01_STACK_WATERMARK
+    PaintStack(m_stack, m_stacksize);
+#endif
+    MakeContext(&m_ctx, m_stack, m_stacksize, &Fiber::MainFunc);
 
     EVA_LOG_DEBUG(g_logger) << "Fiber() id: " << m_id;
 }
@@ -47,13 +105,8 @@ Fiber::Fiber()
 
     ++s_fiber_count;
 
-    if(getcontext(&m_ctx)) {
-        ASSERT(false);
-    };
-
-    m_ctx.uc_link = nullptr;
-    m_ctx.uc_stack.ss_sp = m_stack;
-    m_ctx.uc_stack.ss_size = sizeof(m_stack);
+    // The main fiber runs on the thread stack and owns no stack of its own.
+    // Its context is filled in by the first switch out of it.
 
     EVA_LOG_DEBUG(g_logger) << "Fiber main fiber id: " << m_id;
 }
@@ -71,23 +124,35 @@ Fiber::~Fiber() {
         }
     }
 
+    if (m_stack) {
+        StackAllocator::Dealloc(m_stack, m_stacksize);
+    }
+    free(m_saved_stack);
+    unbind();
+
     EVA_LOG_DEBUG(g_logger) << "~Fiber id: " << m_id;
 }
 
-void Fiber::reset(std::function<void()> func) {
+void Fiber::reset(InlineFunction func) {
     ASSERT(t_main_fiber);
 
-    if(getcontext(&m_ctx)) {
-        ASSERT(false);
-    }
-
     m_func = std::move(func);
     m_state = READY;
-    m_ctx.uc_link = &t_main_fiber->m_ctx;
-    m_ctx.uc_stack.ss_sp = m_stack;
-    m_ctx.uc_stack.ss_size = sizeof(m_stack);
+    m_stack_used = 0;
+    m_exception = nullptr;
+
+    if (m_shared) {
+        m_need_make = true;
+        unbind();
+        m_saved_size = 0;
+        return;
+    }
 
-    makecontext(&m_ctx, &Fiber::MainFunc, 0);
+    ASSERT(m_stack);
+#ifdef EVA01_STACK_WATERMARK
+    PaintStack(m_stack, m_stacksize);
+#endif
+    MakeContext(&m_ctx, m_stack, m_stacksize, &Fiber::MainFunc);
 }
 
 void Fiber::MakeMain() {
@@ -102,15 +167,118 @@ void Fiber::call() {
     if (m_main && t_fiber == t_main_fiber.get()) {
         return;
     }
-    t_fiber = this;
 
-    ASSERT(m_state != RUNNING && m_state != TERM);
+    Fiber::ptr next; // keeps a fiber handed on through the main fiber alive
+    Fiber* fiber = this;
+    Fiber* back = nullptr;
+    while (true) {
+        ASSERT(fiber->m_state != RUNNING && fiber->m_state != TERM);
+        t_fiber = fiber;
+        fiber->m_state = RUNNING;
 
-    m_state = RUNNING;
-    
-    if(swapcontext(&t_main_fiber->m_ctx, &m_ctx)) {
-        ASSERT(false);
+        if (fiber->m_shared) {
+            fiber->restoreStack();
+        }
+
+        SwapContext(&t_main_fiber->m_ctx, &fiber->m_ctx);
+
+        // Back on the thread stack, the shared stack is free to be copied.
+        back = t_back;
+        if (back->m_shared) {
+            back->saveStack();
+        }
+        if (t_unlock) {
+            t_unlock->unlock();
+            t_unlock = nullptr;
+        }
+
+        if (!t_next) {
+            break;
+        }
+        next = std::move(t_next);
+        fiber = next.get();
+    }
+
+    if (back != this) {
+        t_returned = back->shared_from_this();
+    }
+}
+
+void Fiber::TransferTo(const Fiber::ptr& to) {
+    Fiber* cur = t_fiber;
+    if (!cur || cur == t_main_fiber.get()) {
+        to->call();
+        return;
+    }
+    ASSERT(to.get() != cur);
+    ASSERT(to->m_state != RUNNING && !to->isDone());
+
+    cur->m_state = SUSPEND;
+
+    // Shared stacks are copied in and out on the thread stack, so the main
+    // fiber has to do the hand-over.
+    if (cur->m_shared || to->m_shared) {
+        t_next = to;
+        t_back = cur;
+        t_fiber = t_main_fiber.get();
+        SwapContext(&cur->m_ctx, &t_main_fiber->m_ctx);
+        return;
     }
+
+    to->m_state = RUNNING;
+    t_fiber = to.get();
+    SwapContext(&cur->m_ctx, &to->m_ctx);
+}
+
+Fiber::ptr Fiber::TakeReturned() {
+    return std::move(t_returned);
+}
+
+void Fiber::restoreStack() {
+    char* stack = (char*)t_shared_stack.get();
+    if (m_need_make) {
+        m_home_thread = GetThreadId();
+        m_home_count = t_shared_stack.bound;
+        ++*m_home_count;
+        m_need_make = false;
+        MakeContext(&m_ctx, stack, SHARED_STACK_SIZE, &Fiber::MainFunc);
+        return;
+    }
+
+    ASSERT(m_home_thread == GetThreadId());
+    memcpy(stack + SHARED_STACK_SIZE - m_saved_size, m_saved_stack, m_saved_size);
+}
+
+void Fiber::saveStack() {
+    if (isDone()) {
+        free(m_saved_stack);
+        m_saved_stack = nullptr;
+        m_saved_size = m_saved_capacity = 0;
+        unbind();
+        return;
+    }
+
+    char* top = (char*)t_shared_stack.get() + SHARED_STACK_SIZE;
+    char* sp = (char*)GetContextStackPointer(&m_ctx);
+    ASSERT(sp > top - SHARED_STACK_SIZE && sp <= top);
+
+    m_saved_size = top - sp;
+    // Keep the buffer right-sized: grow to fit, shrink once mostly unused.
+    if (m_saved_size > m_saved_capacity || m_saved_size < m_saved_capacity / 4) {
+        free(m_saved_stack);
+        m_saved_stack = (char*)malloc(m_saved_size);
+        ASSERT(m_saved_stack || !m_saved_size);
+        m_saved_capacity = m_saved_size;
+    }
+    memcpy(m_saved_stack, sp, m_saved_size);
+}
+
+void Fiber::unbind() {
+    if (m_home_count) {
+        --*m_home_count;
+        m_home_count.reset();
+    }
+    m_home_thread = 0;
 }
 
 void Fiber::yield() {
@@ -119,9 +287,8 @@ void Fiber::yield() {
         return;
     }
     t_fiber = t_main_fiber.get();
-    if(swapcontext(&m_ctx, &t_main_fiber->m_ctx)) {
-        ASSERT(false);
-    };
+    t_back = this;
+    SwapContext(&m_ctx, &t_main_fiber->m_ctx);
 }
 
 void Fiber::Yield() {
@@ -132,11 +299,9 @@ void Fiber::Yield() {
     Fiber::ptr cur = GetThis();
     cur->m_state = SUSPEND;
     t_fiber = t_main_fiber.get();
+    t_back = cur.get();
 
-    if(swapcontext(&cur->m_ctx, &t_main_fiber->m_ctx)) {
-        ASSERT(false);
-    };
-
+    SwapContext(&cur->m_ctx, &t_main_fiber->m_ctx);
 }
 
 void Fiber::YieldReady() {
@@ -147,11 +312,20 @@ void Fiber::YieldReady() {
     Fiber::ptr cur = GetThis();
     cur->m_state = READY;
     t_fiber = t_main_fiber.get();
+    t_back = cur.get();
+
+    SwapContext(&cur->m_ctx, &t_main_fiber->m_ctx);
+}
 
-    if(swapcontext(&cur->m_ctx, &t_main_fiber->m_ctx)) {
-        ASSERT(false);
-    };
+void Fiber::YieldUnlock(Mutex& mutex) {
+    Fiber* cur = t_fiber;
+    ASSERT(cur && cur != t_main_fiber.get());
+    cur->m_state = SUSPEND;
+    t_fiber = t_main_fiber.get();
+    t_back = cur;
+    t_unlock = &mutex;
 
+    SwapContext(&cur->m_ctx, &t_main_fiber->m_ctx);
 }
 
 Fiber::ptr Fiber::GetMainFiber() {
@@ -163,10 +337,79 @@ Fiber::ptr Fiber::GetMainFiber() {
     }
 }
 
+// Whether a yield was requested for the calling fiber, taking the request.
+// Runs from the entry hook below, so it must not be instrumented itself.
+__attribute__((no_instrument_function))
+static bool TakeYieldRequest() {
+    std::atomic<int>* request = t_yield_request;
+    if (!request || request->load(std::memory_order_relaxed) != Fiber::YIELD_REQUESTED ||
+        t_fiber == t_main_fiber.get()) {
+        return false;
+    }
+    *request = Fiber::YIELDED;
+    return true;
+}
+
+__attribute__((no_instrument_function))
+bool Fiber::MaybeYield() {
+    if (!TakeYieldRequest()) {
+        return false;
+    }
+    YieldReady();
+    return true;
+}
+
+void Fiber::SetYieldRequest(std::atomic<int>* request) {
+    t_yield_request = request;
+}
+
+#ifdef EVA01_PREEMPT_INSTRUMENT
+// Code built with -finstrument-functions gets a safe point at the entry of
+// every function. It must not call into instrumented code with a lock held
+// that other fibers of the thread take.
+//
+// Set while the hook looks at the request: the inline functions it uses may
+// be instrumented in turn. Clear again before the fiber switches, it may go
+// on on another thread.
+static thread_local bool t_in_entry_hook = false;
+
+extern "C" {
+__attribute__((no_instrument_function))
+void __cyg_profile_func_enter(void*, void*) {
+    if (t_in_entry_hook) {
+        return;
+    }
+    t_in_entry_hook = true;
+    bool yield = TakeYieldRequest();
+    t_in_entry_hook = false;
+    if (yield) {
+        Fiber::YieldReady(); // its own entry finds the request taken
+    }
+}
+
+__attribute__((no_instrument_function))
+void __cyg_profile_func_exit(void*, void*) {
+}
+}
+#endif
+
 uint64_t Fiber::GetTotalCount() {
     return s_fiber_count;
 }
 
+size_t Fiber::GetMaxStackHighWater() {
+    return s_max_stack_used;
+}
+
+bool Fiber::OnSharedStack() {
+    Fiber* cur = t_fiber;
+    return cur && cur->m_shared;
+}
+
+size_t Fiber::GetBoundCount() {
+    return t_shared_stack.bound->load();
+}
+
 uint64_t Fiber::GetFiberId() {
     if (t_fiber) {
         return t_fiber->getId();
@@ -191,8 +434,26 @@ void Fiber::MainFunc() {
     }
     catch(std::exception &ex) {
         cur->m_state = EXCEPT;
+        cur->m_exception = std::current_exception();
         EVA_LOG_ERROR(g_logger) << "Exception: " << ex.what();
     }
+    catch(...) {
+        cur->m_state = EXCEPT;
+        cur->m_exception = std::current_exception();
+        EVA_LOG_ERROR(g_logger) << "Exception: unknown";
+    }
+
+#ifdef EVA01_STACK_WATERMARK
+    if (cur->m_stack) {
+        cur->m_stack_used = MeasureStack(cur->m_stack, cur->m_stacksize);
+        size_t max_used = s_max_stack_used;
+        while (cur->m_stack_used > max_used &&
+               !s_max_stack_used.compare_exchange_weak(max_used, cur->m_stack_used)) {
+        }
+        EVA_LOG_INFO(g_logger) << "Fiber id: " << cur->m_id << " stack high-water mark: "
+            << cur->m_stack_used << " of " << cur->m_stacksize << " bytes";
+    }
+#endif
 
     //!!Important: swap out manually to free the pointer cur.
     auto raw_ptr = cur.get();
@@ -1,12 +1,19 @@
 #pragma once
 
+#include <atomic>
 #include <memory>
-#include <ucontext.h>
 #include <functional>
+#include <exception>
+#include <sys/types.h>
+#include "context.h"
+#include "inline_function.h"
 
 namespace eva01 {
 
-#define STACKSIZE 1024*1024 // 1mb
+class Mutex;
+
+constexpr const size_t DEFAULT_STACK_SIZE = 1024 * 1024; // 1mb
+constexpr const size_t SHARED_STACK_SIZE = 1024 * 1024; // per thread, see Fiber(..., shared_stack)
 
 class Fiber : public std::enable_shared_from_this<Fiber>{
 
@@ -21,19 +28,46 @@ public:
         EXCEPT
     };
 
+    // Values of a yield request flag, see MaybeYield().
+    enum YieldRequest {
+        NO_YIELD = 0,
+        YIELD_REQUESTED,
+        YIELDED
+    };
+
 public:
-    Fiber(std::function<void()> func, bool is_main = false);
+    // stacksize 0 means DEFAULT_STACK_SIZE.
+    //
+    // A shared_stack fiber owns no stack: it runs on an execution stack
+    // shared by all such fibers of a thread, and the used part is copied
+    // out to a right-sized buffer whenever it switches out. It is bound to
+    // the thread of its first call() until it is reset. stacksize is ignored.
+    Fiber(InlineFunction func, size_t stacksize = 0, bool shared_stack = false);
     State getState() const { return m_state; }
     uint64_t getId() const { return m_id; }
+    size_t getStackSize() const { return m_stacksize; }
+    bool isSharedStack() const { return m_shared; }
+    // Thread a shared stack fiber is bound to, 0 if it is not bound.
+    pid_t getHomeThread() const { return m_home_thread; }
+    // Bytes of stack a suspended shared stack fiber keeps aside.
+    size_t getSavedStackSize() const { return m_saved_size; }
+    // Deepest stack usage of the last run, measured when the fiber terminates.
+    // Always 0 unless built with EVA01_STACK_WATERMARK.
+    size_t getStackHighWater() const { return m_stack_used; }
+    // What the function threw when the fiber ended in EXCEPT, null otherwise.
+    std::exception_ptr getException() const { return m_exception; }
     ~Fiber();
 
 private:
     Fiber();
+    void restoreStack();
+    void saveStack();
+    void unbind();
 
 public:
     void call();
     void yield();
-    void reset(std::function<void()> func);
+    void reset(InlineFunction func);
     bool isDone() const { return m_state == TERM || m_state == EXCEPT; }
 
 public:
@@ -43,16 +77,55 @@ public:
     static void MakeMain();
     static void Yield();
     static void YieldReady();
+    // Suspend the current fiber and unlock mutex once it has switched out,
+    // so whoever resumes it under that mutex never finds it still running.
+    // The mutex has to be locked by this thread.
+    static void YieldUnlock(Mutex& mutex);
+    // A safe point for cooperative preemption: yield, staying READY, if a
+    // yield was requested for this thread, otherwise only a flag test. True
+    // if it yielded. Scheduler::setTimeSlice() requests yields of fibers
+    // that run too long.
+    static bool MaybeYield();
+    // Flag the calling thread looks at in MaybeYield(), nullptr for none.
+    static void SetYieldRequest(std::atomic<int>* request);
+    // Switch from the current fiber straight to `to`, without a round
+    // through the main fiber. The current fiber is left SUSPEND, whoever
+    // holds it has to call() or transfer to it again. The caller keeps `to`
+    // alive until it switches back.
+    static void TransferTo(const Fiber::ptr& to);
+    // The fiber that switched back to the main fiber in the last call(), if
+    // it is not the fiber that was called. It differs when control was
+    // handed on with TransferTo().
+    static Fiber::ptr TakeReturned();
     static uint64_t GetTotalCount();
     static uint64_t GetFiberId();
+    // Whether the calling fiber runs on a shared stack. Whatever it keeps
+    // on its stack is not in place while it is switched out, so others
+    // must not write there meanwhile.
+    static bool OnSharedStack();
+    // Shared stack fibers bound to the calling thread that are not done.
+    // They can only ever run on it again.
+    static size_t GetBoundCount();
+    static size_t GetMaxStackHighWater();
 
 private:
     uint64_t m_id = 0;
-    ucontext_t m_ctx;
-    std::function<void()> m_func;
+    Context m_ctx;
+    InlineFunction m_func;
     bool m_main;
-    char m_stack[STACKSIZE];
+    void* m_stack = nullptr;
+    size_t m_stacksize = 0;
+    size_t m_stack_used = 0;
     State m_state = READY;
+    std::exception_ptr m_exception;
+
+    bool m_shared = false;
+    bool m_need_make = false;
+    pid_t m_home_thread = 0;
+    std::shared_ptr<std::atomic<size_t>> m_home_count; // of the home thread
+    char* m_saved_stack = nullptr;
+    size_t m_saved_size = 0;
+    size_t m_saved_capacity = 0;
 
 };
 
@@ -0,0 +1,293 @@
+#include "src/fiber_sync.h"
+#include "src/macro.h"
+#include "src/scheduler.h"
+#include "src/semaphore.h"
+
+namespace eva01 {
+
+constexpr const int PARK_UNCLAIMED = -2;
+
+FiberParker::FiberParker()
+    : m_token(PARK_UNCLAIMED) {
+    Scheduler* scheduler = Scheduler::GetThis();
+    if (scheduler && Fiber::GetThis().get() != Scheduler::GetMainFiber()) {
+        m_scheduler = scheduler;
+        m_fiber = Fiber::GetThis();
+    }
+}
+
+bool FiberParker::claim(int token) {
+    int unclaimed = PARK_UNCLAIMED;
+    return m_token.compare_exchange_strong(unclaimed, token);
+}
+
+void FiberParker::park(uint64_t timeout_ms) {
+    if (!m_fiber) {
+        if (timeout_ms != ~0ull) {
+            if (m_sem.waitFor(timeout_ms) || claim(PARK_TIMED_OUT)) {
+                return;
+            }
+            // A waker claimed us meanwhile, its unpark() is on the way.
+        }
+        m_sem.wait();
+        return;
+    }
+
+    TimerManager::Timer::ptr timer;
+    if (timeout_ms != ~0ull) {
+        FiberParker::ptr self = shared_from_this();
+        timer = m_scheduler->addTimer(timeout_ms, [self]() {
+            if (self->claim(PARK_TIMED_OUT)) {
+                self->unpark();
+            }
+        });
+    }
+
+    m_mutex.lock();
+    if (m_woken) {
+        m_fiber.reset();
+        m_mutex.unlock();
+    } else {
+        // unpark() hands our reference to the scheduler
+        m_parked = true;
+        Fiber::YieldUnlock(m_mutex);
+    }
+
+    if (timer) {
+        timer->cancel();
+    }
+}
+
+void FiberParker::unpark() {
+    if (!m_scheduler) {
+        m_sem.notify();
+        return;
+    }
+
+    MutexGuard<Mutex> lk(m_mutex);
+    m_woken = true;
+    if (m_parked) {
+        Scheduler* scheduler = m_scheduler;
+        scheduler->scheduleNext(std::move(m_fiber));
+    }
+}
+
+void FiberWaitQueue::wait(Mutex& mutex) {
+    // The waiter is read by whoever wakes us. The stack of a parked shared
+    // stack fiber is copied out and the next one runs in its place, so the
+    // waiter of such a fiber goes to the heap.
+    Scheduler* scheduler = Scheduler::GetThis();
+    Fiber::ptr self;
+    if (scheduler && Fiber::GetThis().get() != Scheduler::GetMainFiber()) {
+        self = Fiber::GetThis();
+    }
+    Waiter local;
+    std::unique_ptr<Waiter> heap;
+    Waiter* waiter = &local;
+    if (self && self->isSharedStack()) {
+        heap.reset(new Waiter);
+        waiter = heap.get();
+    }
+    if (self) {
+        waiter->scheduler = scheduler;
+        waiter->fiber = std::move(self);
+    }
+
+    if (m_tail) {
+        m_tail->next = waiter;
+    } else {
+        m_head = waiter;
+    }
+    m_tail = waiter;
+
+    if (waiter->fiber) {
+        // The reference in the waiter keeps the fiber alive while parked.
+        Fiber::YieldUnlock(mutex);
+        return;
+    }
+
+    Semaphore sem;
+    waiter->sem = &sem;
+    mutex.unlock();
+    sem.wait();
+}
+
+bool FiberWaitQueue::notify() {
+    Waiter* waiter = m_head;
+    if (!waiter) {
+        return false;
+    }
+    m_head = waiter->next;
+    if (!m_head) {
+        m_tail = nullptr;
+    }
+    wake(waiter);
+    return true;
+}
+
+size_t FiberWaitQueue::notifyAll() {
+    size_t count = 0;
+    while (notify()) {
+        ++count;
+    }
+    return count;
+}
+
+void FiberWaitQueue::wake(Waiter* waiter) {
+    // waiter belongs to the parked caller, it is gone as soon as the
+    // caller runs again.
+    if (waiter->fiber) {
+        Scheduler* scheduler = waiter->scheduler;
+        scheduler->scheduleNext(std::move(waiter->fiber));
+    } else {
+        waiter->sem->notify();
+    }
+}
+
+void FiberMutex::lock() {
+    m_mutex.lock();
+    if (!m_locked) {
+        m_locked = true;
+        m_mutex.unlock();
+        return;
+    }
+    m_waiters.wait(m_mutex); // unlock() hands the lock over
+}
+
+bool FiberMutex::tryLock() {
+    MutexGuard<Mutex> lk(m_mutex);
+    if (m_locked) {
+        return false;
+    }
+    m_locked = true;
+    return true;
+}
+
+void FiberMutex::unlock() {
+    MutexGuard<Mutex> lk(m_mutex);
+    ASSERT(m_locked);
+    if (!m_waiters.notify()) {
+        m_locked = false;
+    }
+}
+
+void FiberCondVar::wait(FiberMutex& mutex) {
+    // Queue up before mutex is released, a notify under mutex cannot be missed.
+    m_mutex.lock();
+    mutex.unlock();
+    m_waiters.wait(m_mutex);
+    mutex.lock();
+}
+
+void FiberCondVar::notify() {
+    MutexGuard<Mutex> lk(m_mutex);
+    m_waiters.notify();
+}
+
+void FiberCondVar::notifyAll() {
+    MutexGuard<Mutex> lk(m_mutex);
+    m_waiters.notifyAll();
+}
+
+FiberSemaphore::FiberSemaphore(uint32_t count)
+    : m_count(count) {
+}
+
+void FiberSemaphore::wait() {
+    m_mutex.lock();
+    if (m_count > 0) {
+        --m_count;
+        m_mutex.unlock();
+        return;
+    }
+    m_waiters.wait(m_mutex); // notify() hands its count over
+}
+
+bool FiberSemaphore::tryWait() {
+    MutexGuard<Mutex> lk(m_mutex);
+    if (m_count == 0) {
+        return false;
+    }
+    --m_count;
+    return true;
+}
+
+void FiberSemaphore::notify() {
+    MutexGuard<Mutex> lk(m_mutex);
+    if (!m_waiters.notify()) {
+        ++m_count;
+    }
+}
+
+uint32_t FiberSemaphore::getCount() {
+    MutexGuard<Mutex> lk(m_mutex);
+    return m_count;
+}
+
+void WaitGroup::add(size_t count) {
+    MutexGuard<Mutex> lk(m_mutex);
+    m_count += count;
+}
+
+void WaitGroup::done() {
+    MutexGuard<Mutex> lk(m_mutex);
+    ASSERT(m_count > 0);
+    if (--m_count == 0) {
+        m_waiters.notifyAll();
+    }
+}
+
+void WaitGroup::wait() {
+    m_mutex.lock();
+    if (m_count == 0) {
+        m_mutex.unlock();
+        return;
+    }
+    m_waiters.wait(m_mutex);
+}
+
+void FiberRWMutex::rdlock() {
+    m_mutex.lock();
+    if (!m_writer && m_write_waiters.empty()) {
+        ++m_readers;
+        m_mutex.unlock();
+        return;
+    }
+    m_read_waiters.wait(m_mutex); // counted in m_readers by unlock()
+}
+
+void FiberRWMutex::wrlock() {
+    m_mutex.lock();
+    if (!m_writer && m_readers == 0) {
+        m_writer = true;
+        m_mutex.unlock();
+        return;
+    }
+    m_write_waiters.wait(m_mutex); // m_writer is set by unlock()
+}
+
+void FiberRWMutex::unlock() {
+    MutexGuard<Mutex> lk(m_mutex);
+    bool was_writer = m_writer;
+    if (m_writer) {
+        m_writer = false;
+    } else {
+        ASSERT(m_readers > 0);
+        --m_readers;
+    }
+    if (m_readers > 0) {
+        return;
+    }
+
+    // Alternate: readers held back by a writer go before the next writer.
+    if (was_writer && !m_read_waiters.empty()) {
+        m_readers = m_read_waiters.notifyAll();
+    } else if (!m_write_waiters.empty()) {
+        m_writer = true;
+        m_write_waiters.notify();
+    } else {
+        m_readers = m_read_waiters.notifyAll();
+    }
+}
+
+}
@@ -0,0 +1,163 @@
+#pragma once
+
+#include "src/fiber.h"
+#include "src/mutex.h"
+#include "src/noncopyable.h"
+#include "src/semaphore.h"
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+namespace eva01 {
+
+class Scheduler;
+
+// Synchronization primitives that park the calling fiber instead of its
+// thread. A waiting fiber is suspended and scheduled again on its scheduler
+// when it is woken, so the thread keeps running other tasks meanwhile.
+// Callers outside of a scheduler fiber (plain threads, the main fiber) block
+// on a Semaphore instead, so both can share one primitive.
+//
+// A parked fiber is not a pending task of its scheduler: stop() does not
+// wait for fibers that are only woken from outside of it.
+
+// Token of a FiberParker that expired, see FiberParker::park().
+constexpr const int PARK_TIMED_OUT = -1;
+
+// One-shot wake-up of a single parked caller that several wakers may race
+// for, e.g. the cases of a Channel select and its timeout. A waker first
+// claims the parker with a token; only the first claim succeeds, and only
+// that waker calls unpark(). The parker belongs to the fiber or thread that
+// created it.
+class FiberParker : public std::enable_shared_from_this<FiberParker>, NonCopyable {
+public:
+    using ptr = std::shared_ptr<FiberParker>;
+
+    FiberParker();
+
+    bool claim(int token);
+    // Token of the successful claim, or a negative number before that.
+    int getToken() const { return m_token; }
+    // Wait until unpark(). If nobody claimed the parker after timeout_ms,
+    // it claims itself with PARK_TIMED_OUT and returns.
+    void park(uint64_t timeout_ms = ~0ull);
+    void unpark();
+
+private:
+    Mutex m_mutex;
+    Scheduler* m_scheduler = nullptr;
+    Fiber::ptr m_fiber;
+    Semaphore m_sem; // used by threads
+    bool m_parked = false;
+    bool m_woken = false;
+    std::atomic<int> m_token;
+};
+
+// FIFO of parked callers, guarded by the mutex of its owner.
+class FiberWaitQueue : public NonCopyable {
+public:
+    // Park the caller until it is notified. mutex is locked on entry and
+    // unlocked once the caller is parked; it is not locked again on return.
+    void wait(Mutex& mutex);
+    // Wake the oldest waiter, false if there is none. mutex is held.
+    bool notify();
+    // Wake all waiters and return how many there were. mutex is held.
+    size_t notifyAll();
+    bool empty() const { return !m_head; }
+
+private:
+    struct Waiter {
+        Scheduler* scheduler = nullptr;
+        Fiber::ptr fiber;
+        Semaphore* sem = nullptr;
+        Waiter* next = nullptr;
+    };
+
+    void wake(Waiter* waiter);
+
+private:
+    Waiter* m_head = nullptr;
+    Waiter* m_tail = nullptr;
+};
+
+// Ownership is handed to the oldest waiter on unlock(), so waiters get the
+// lock in order.
+class FiberMutex : public NonCopyable {
+public:
+    void lock();
+    bool tryLock();
+    void unlock();
+
+private:
+    Mutex m_mutex;
+    bool m_locked = false;
+    FiberWaitQueue m_waiters;
+};
+
+class FiberCondVar : public NonCopyable {
+public:
+    // mutex is unlocked while waiting and locked again before returning.
+    void wait(FiberMutex& mutex);
+
+    template <typename Predicate>
+    void wait(FiberMutex& mutex, Predicate pred) {
+        while (!pred()) {
+            wait(mutex);
+        }
+    }
+
+    void notify();
+    void notifyAll();
+
+private:
+    Mutex m_mutex;
+    FiberWaitQueue m_waiters;
+};
+
+class FiberSemaphore : public NonCopyable {
+public:
+    FiberSemaphore(uint32_t count = 0);
+
+    void wait();
+    bool tryWait();
+    void notify();
+    uint32_t getCount();
+
+private:
+    Mutex m_mutex;
+    uint32_t m_count;
+    FiberWaitQueue m_waiters;
+};
+
+// Wait for a group of tasks: add() before starting them, done() when each
+// one finishes, wait() until all have.
+class WaitGroup : public NonCopyable {
+public:
+    void add(size_t count = 1);
+    void done();
+    void wait();
+
+private:
+    Mutex m_mutex;
+    size_t m_count = 0;
+    FiberWaitQueue m_waiters;
+};
+
+// Readers share the lock. A waiting writer holds back new readers, and the
+// readers that queued up meanwhile go next when the writer unlocks.
+// Use with ReadGuard<FiberRWMutex> / WriteGuard<FiberRWMutex>.
+class FiberRWMutex : public NonCopyable {
+public:
+    void rdlock();
+    void wrlock();
+    void unlock();
+
+private:
+    Mutex m_mutex;
+    size_t m_readers = 0;
+    bool m_writer = false;
+    FiberWaitQueue m_read_waiters;
+    FiberWaitQueue m_write_waiters;
+};
+
+}
@@ -0,0 +1,65 @@
+#include "src/future.h"
+
+namespace eva01 {
+
+bool FutureStateBase::isReady() {
+    MutexGuard<Mutex> lk(m_mutex);
+    return m_ready;
+}
+
+void FutureStateBase::wait() {
+    m_mutex.lock();
+    if (m_ready) {
+        m_mutex.unlock();
+        return;
+    }
+    m_waiters.wait(m_mutex); // only woken once ready
+}
+
+void FutureStateBase::onReady(std::function<void()> cb) {
+    m_mutex.lock();
+    if (!m_ready) {
+        m_callbacks.push_back(std::move(cb));
+        m_mutex.unlock();
+        return;
+    }
+    m_mutex.unlock();
+    cb();
+}
+
+void FutureStateBase::setException(std::exception_ptr ex) {
+    m_mutex.lock();
+    ASSERT(!m_ready);
+    m_exception = std::move(ex);
+    readyAndUnlock();
+}
+
+void FutureStateBase::rethrow() {
+    if (m_exception) {
+        std::rethrow_exception(m_exception);
+    }
+}
+
+void FutureStateBase::abandon() {
+    m_mutex.lock();
+    if (m_ready) {
+        m_mutex.unlock();
+        return;
+    }
+    m_exception = std::make_exception_ptr(std::future_error(std::future_errc::broken_promise));
+    readyAndUnlock();
+}
+
+void FutureStateBase::readyAndUnlock() {
+    m_ready = true;
+    m_waiters.notifyAll();
+    std::vector<std::function<void()>> callbacks;
+    callbacks.swap(m_callbacks);
+    m_mutex.unlock();
+
+    for (auto& cb : callbacks) {
+        cb();
+    }
+}
+
+}
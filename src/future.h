@@ -0,0 +1,202 @@
+#pragma once
+
+#include "src/fiber_sync.h"
+#include "src/macro.h"
+#include "src/mutex.h"
+#include "src/noncopyable.h"
+#include <exception>
+#include <future>
+#include <functional>
+#include <memory>
+#include <vector>
+
+namespace eva01 {
+
+// Shared state of a Promise and its Futures, without the value.
+class FutureStateBase : public NonCopyable {
+public:
+    bool isReady();
+    // Park the caller until the state is ready, see fiber_sync.h.
+    void wait();
+    // Run cb once the state is ready: right away if it is, otherwise on the
+    // thread that makes it ready.
+    void onReady(std::function<void()> cb);
+    void setException(std::exception_ptr ex);
+    // Throw what the producer failed with. The state is ready.
+    void rethrow();
+    // Fail with std::future_errc::broken_promise unless ready.
+    void abandon();
+
+protected:
+    // Publish the result stored under m_mutex and wake all waiters.
+    void readyAndUnlock();
+
+protected:
+    Mutex m_mutex;
+    bool m_ready = false;
+    std::exception_ptr m_exception;
+    FiberWaitQueue m_waiters;
+    std::vector<std::function<void()>> m_callbacks;
+};
+
+template <typename T>
+class FutureState : public FutureStateBase {
+public:
+    using ptr = std::shared_ptr<FutureState>;
+    using Result = const T&;
+
+    void setValue(T value) {
+        m_mutex.lock();
+        ASSERT(!m_ready);
+        m_value.reset(new T(std::move(value)));
+        readyAndUnlock();
+    }
+
+    Result get() { return *m_value; }
+
+private:
+    std::unique_ptr<T> m_value;
+};
+
+template <>
+class FutureState<void> : public FutureStateBase {
+public:
+    using ptr = std::shared_ptr<FutureState>;
+    using Result = void;
+
+    void setValue() {
+        m_mutex.lock();
+        ASSERT(!m_ready);
+        readyAndUnlock();
+    }
+
+    Result get() {}
+};
+
+// Read side of a result that is produced later, e.g. by Scheduler::async.
+// Copies share the result.
+template <typename T>
+class Future {
+public:
+    Future() {}
+    explicit Future(typename FutureState<T>::ptr state)
+        : m_state(std::move(state)) {
+    }
+
+    bool valid() const { return (bool)m_state; }
+    bool isReady() const { return m_state->isReady(); }
+    void wait() const { m_state->wait(); }
+
+    // Wait for the result. Rethrows the exception the producer failed with.
+    typename FutureState<T>::Result get() const {
+        m_state->wait();
+        m_state->rethrow();
+        return m_state->get();
+    }
+
+    const typename FutureState<T>::ptr& getState() const { return m_state; }
+
+private:
+    typename FutureState<T>::ptr m_state;
+};
+
+// Write side of a Future. Set the value or an exception exactly once.
+// Copies share the state; if the last copy goes away without either, e.g.
+// with a task that was dropped, the Future fails with broken_promise.
+template <typename T>
+class Promise {
+public:
+    Promise()
+        : m_state(std::make_shared<FutureState<T>>())
+        , m_keeper(std::make_shared<Keeper>(m_state)) {
+    }
+
+    Future<T> getFuture() const { return Future<T>(m_state); }
+
+    template <typename... Args>
+    void setValue(Args&&... args) const { m_state->setValue(std::forward<Args>(args)...); }
+    void setException(std::exception_ptr ex) const { m_state->setException(std::move(ex)); }
+
+private:
+    struct Keeper {
+        explicit Keeper(std::shared_ptr<FutureStateBase> state)
+            : state(std::move(state)) {
+        }
+        ~Keeper() { state->abandon(); }
+
+        std::shared_ptr<FutureStateBase> state;
+    };
+
+    typename FutureState<T>::ptr m_state;
+    std::shared_ptr<Keeper> m_keeper;
+};
+
+// Run func and store its result or exception in promise.
+template <typename T, typename Func>
+void FulfillPromise(const Promise<T>& promise, Func& func) {
+    try {
+        promise.setValue(func());
+    } catch (...) {
+        promise.setException(std::current_exception());
+    }
+}
+
+template <typename Func>
+void FulfillPromise(const Promise<void>& promise, Func& func) {
+    try {
+        func();
+        promise.setValue();
+    } catch (...) {
+        promise.setException(std::current_exception());
+    }
+}
+
+// Ready once all futures are. Fails with the first exception among them;
+// the values are read from the futures themselves.
+template <typename T>
+Future<void> WhenAll(const std::vector<Future<T>>& futures) {
+    struct Join {
+        Mutex mutex;
+        size_t pending;
+        std::exception_ptr ex;
+        Promise<void> promise;
+    };
+
+    auto join = std::make_shared<Join>();
+    join->pending = futures.size() + 1; // one for the registration below
+    Future<void> result = join->promise.getFuture();
+
+    auto arrive = [join](std::exception_ptr ex) {
+        join->mutex.lock();
+        if (ex && !join->ex) {
+            join->ex = ex;
+        }
+        bool last = --join->pending == 0;
+        join->mutex.unlock();
+        if (!last) {
+            return;
+        }
+        if (join->ex) {
+            join->promise.setException(join->ex);
+        } else {
+            join->promise.setValue();
+        }
+    };
+
+    for (auto& f : futures) {
+        FutureStateBase* state = f.getState().get(); // alive while it runs callbacks
+        state->onReady([state, arrive]() {
+            std::exception_ptr ex;
+            try {
+                state->rethrow();
+            } catch (...) {
+                ex = std::current_exception();
+            }
+            arrive(ex);
+        });
+    }
+    arrive(nullptr);
+    return result;
+}
+
+}
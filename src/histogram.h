@@ -0,0 +1,87 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace eva01 {
+
+// Counts of values in power of 2 buckets: bucket 0 holds 0, bucket i the
+// values in [2^(i-1), 2^i), the last one everything above. Coarse, but it
+// tells a 10us wait from a 10ms one at the cost of a few counters.
+struct Histogram {
+    static constexpr size_t BUCKETS = 40;
+
+    uint64_t counts[BUCKETS] = {};
+
+    static size_t Bucket(uint64_t value) {
+        size_t i = value ? 64 - __builtin_clzll(value) : 0;
+        return i < BUCKETS ? i : BUCKETS - 1;
+    }
+
+    // Largest value that goes to bucket i.
+    static uint64_t UpperBound(size_t i) {
+        return i ? (1ull << i) - 1 : 0;
+    }
+
+    uint64_t count() const {
+        uint64_t n = 0;
+        for (uint64_t c : counts) {
+            n += c;
+        }
+        return n;
+    }
+
+    // Upper bound of the bucket the q-quantile falls in, q in [0, 1].
+    // 0 without values.
+    uint64_t percentile(double q) const {
+        uint64_t n = count();
+        if (!n) {
+            return 0;
+        }
+        uint64_t rank = (uint64_t)(q * (n - 1)) + 1;
+        uint64_t seen = 0;
+        for (size_t i = 0; i < BUCKETS; ++i) {
+            seen += counts[i];
+            if (seen >= rank) {
+                return UpperBound(i);
+            }
+        }
+        return UpperBound(BUCKETS - 1);
+    }
+
+    void merge(const Histogram& other) {
+        for (size_t i = 0; i < BUCKETS; ++i) {
+            counts[i] += other.counts[i];
+        }
+    }
+};
+
+// A Histogram that one thread adds to while others take snapshots. The
+// owner adds with plain loads and stores, no locked instructions.
+class HistogramRecorder {
+public:
+    HistogramRecorder() {
+        for (auto& c : m_counts) {
+            c.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    // Owner thread only.
+    void add(uint64_t value) {
+        auto& c = m_counts[Histogram::Bucket(value)];
+        c.store(c.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    // Any thread, adds the counts to h.
+    void addTo(Histogram& h) const {
+        for (size_t i = 0; i < Histogram::BUCKETS; ++i) {
+            h.counts[i] += m_counts[i].load(std::memory_order_relaxed);
+        }
+    }
+
+private:
+    std::atomic<uint64_t> m_counts[Histogram::BUCKETS];
+};
+
+}
@@ -145,11 +145,7 @@ unsigned int sleep(unsigned int seconds)
     eva01::Fiber::ptr fiber = eva01::Fiber::GetThis();
     eva01::IOManager* iom = eva01::IOManager::GetThis();
 
-    iom->addTimer(
-        seconds * 1000,
-        std::bind((void(eva01::Scheduler::*)(eva01::Fiber::ptr, int thread)) &
-                      eva01::IOManager::schedule,
-                  iom, fiber, -1));
+    iom->addTimer(seconds * 1000, [iom, fiber]() { iom->schedule(fiber); });
     eva01::Fiber::Yield();
     return 0;
 };
@@ -163,11 +159,7 @@ int usleep(useconds_t usec)
     eva01::Fiber::ptr fiber = eva01::Fiber::GetThis();
     eva01::IOManager* iom = eva01::IOManager::GetThis();
 
-    iom->addTimer(
-        usec / 1000,
-        std::bind((void(eva01::Scheduler::*)(eva01::Fiber::ptr, int thread)) &
-                      eva01::IOManager::schedule,
-                  iom, fiber, -1));
+    iom->addTimer(usec / 1000, [iom, fiber]() { iom->schedule(fiber); });
     eva01::Fiber::Yield();
     return 0;
 };
@@ -0,0 +1,139 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace eva01 {
+
+// Move-only void() callable. Callables of up to INLINE_SIZE bytes are kept
+// in place, only bigger ones go to the heap. Unlike std::function it takes
+// callables that cannot be copied, e.g. lambdas capturing a unique_ptr.
+class InlineFunction {
+public:
+    static constexpr size_t INLINE_SIZE = 6 * sizeof(void*);
+
+    InlineFunction() {}
+    InlineFunction(std::nullptr_t) {}
+
+    // An empty std::function makes an empty InlineFunction.
+    InlineFunction(std::function<void()> func) {
+        if (func) {
+            assign(std::move(func));
+        }
+    }
+
+    template <typename F, typename D = typename std::decay<F>::type,
+              typename = typename std::enable_if<
+                  !std::is_same<D, InlineFunction>::value &&
+                  !std::is_same<D, std::function<void()>>::value>::type,
+              typename = decltype(std::declval<D&>()())>
+    InlineFunction(F&& func) {
+        assign(std::forward<F>(func));
+    }
+
+    InlineFunction(InlineFunction&& other) noexcept {
+        moveFrom(other);
+    }
+
+    InlineFunction& operator=(InlineFunction&& other) noexcept {
+        if (this != &other) {
+            clear();
+            moveFrom(other);
+        }
+        return *this;
+    }
+
+    InlineFunction(const InlineFunction&) = delete;
+    InlineFunction& operator=(const InlineFunction&) = delete;
+
+    ~InlineFunction() { clear(); }
+
+    explicit operator bool() const { return m_ops != nullptr; }
+
+    void operator()() { m_ops->invoke(m_buf); }
+
+    // true if the callable lives on the heap.
+    bool isHeap() const { return m_ops && m_ops->heap; }
+
+private:
+    struct Ops {
+        void (*invoke)(void* buf);
+        // Move the callable in from to the empty buffer to, destroying it in from.
+        void (*move)(void* from, void* to);
+        void (*destroy)(void* buf);
+        bool heap;
+    };
+
+    template <typename D>
+    struct Inline {
+        static void Invoke(void* buf) { (*static_cast<D*>(buf))(); }
+        static void Move(void* from, void* to) {
+            new (to) D(std::move(*static_cast<D*>(from)));
+            static_cast<D*>(from)->~D();
+        }
+        static void Destroy(void* buf) { static_cast<D*>(buf)->~D(); }
+        static constexpr Ops ops = { &Invoke, &Move, &Destroy, false };
+    };
+
+    template <typename D>
+    struct Heap {
+        static void Invoke(void* buf) { (**static_cast<D**>(buf))(); }
+        static void Move(void* from, void* to) { *static_cast<D**>(to) = *static_cast<D**>(from); }
+        static void Destroy(void* buf) { delete *static_cast<D**>(buf); }
+        static constexpr Ops ops = { &Invoke, &Move, &Destroy, true };
+    };
+
+    template <typename D>
+    using Fits = std::integral_constant<bool,
+        sizeof(D) <= INLINE_SIZE && alignof(D) <= alignof(std::max_align_t) &&
+        std::is_nothrow_move_constructible<D>::value>;
+
+    template <typename F>
+    void assign(F&& func) {
+        assign(std::forward<F>(func), Fits<typename std::decay<F>::type>());
+    }
+
+    template <typename F>
+    void assign(F&& func, std::true_type) {
+        using D = typename std::decay<F>::type;
+        new (m_buf) D(std::forward<F>(func));
+        m_ops = &Inline<D>::ops;
+    }
+
+    template <typename F>
+    void assign(F&& func, std::false_type) {
+        using D = typename std::decay<F>::type;
+        *reinterpret_cast<D**>(m_buf) = new D(std::forward<F>(func));
+        m_ops = &Heap<D>::ops;
+    }
+
+    void moveFrom(InlineFunction& other) {
+        if (other.m_ops) {
+            other.m_ops->move(other.m_buf, m_buf);
+            m_ops = other.m_ops;
+            other.m_ops = nullptr;
+        }
+    }
+
+    void clear() {
+        if (m_ops) {
+            m_ops->destroy(m_buf);
+            m_ops = nullptr;
+        }
+    }
+
+private:
+    const Ops* m_ops = nullptr;
+    alignas(std::max_align_t) unsigned char m_buf[INLINE_SIZE];
+};
+
+template <typename D>
+constexpr InlineFunction::Ops InlineFunction::Inline<D>::ops;
+
+template <typename D>
+constexpr InlineFunction::Ops InlineFunction::Heap<D>::ops;
+
+}
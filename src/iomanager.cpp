@@ -11,8 +11,9 @@ static Logger::ptr g_logger = EVA_LOGGER("system");
 
 constexpr const size_t DEFAULT_FD_CONTEXTS_SIZE = 32;
 
-IOManager::IOManager(int threads, const std::string& name)
-        : Scheduler(threads, name) {
+IOManager::IOManager(int threads, const std::string& name, ReactorMode mode, bool use_caller)
+        : Scheduler(threads, name, use_caller) {
+    setReactorMode(mode);
     start();
     resizeContexts(DEFAULT_FD_CONTEXTS_SIZE);
 }
@@ -63,12 +64,19 @@ bool IOManager::addEvent(int fd, Event event, std::function<void()> func) {
     MutexGuard<Mutex> lk(fd_ctx->mtx);
 
     int op = fd_ctx->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    if (op == EPOLL_CTL_ADD) {
+        fd_ctx->epfd = pickEpoll(); // stays there until its events are gone
+        if (fd_ctx->epfd < 0) {
+            EVA_LOG_ERROR(g_logger) << "addEvent: scheduler stopped, fd=" << fd;
+            return false;
+        }
+    }
     epoll_event epevent;
 
     epevent.events = EPOLLET | fd_ctx->events | event;
     epevent.data.ptr = fd_ctx;
 
-    int rt = epoll_ctl(m_epfd, op, fd, &epevent);
+    int rt = epoll_ctl(fd_ctx->epfd, op, fd, &epevent);
     ASSERT(!rt);
     fd_ctx->events = (Event)(fd_ctx->events | event);
     ++m_pending_count;
@@ -111,7 +119,7 @@ bool IOManager::delEvent(int fd, Event event) {
     epevent.events = EPOLLET | left_events;
     epevent.data.ptr = fd_ctx;
 
-    int rt = epoll_ctl(m_epfd, op, fd, &epevent);
+    int rt = epoll_ctl(fd_ctx->epfd, op, fd, &epevent);
     ASSERT(!rt);
 
     fd_ctx->events = left_events;
@@ -142,7 +150,7 @@ bool IOManager::cancelEvent(int fd, Event event) {
     epevent.events = EPOLLET | left_events;
     epevent.data.ptr = fd_ctx;
 
-    int rt = epoll_ctl(m_epfd, op, fd, &epevent);
+    int rt = epoll_ctl(fd_ctx->epfd, op, fd, &epevent);
     ASSERT(!rt);
 
     --m_pending_count;
@@ -169,9 +177,9 @@ bool IOManager::cancelAll(int fd) {
     epevent.events = 0;
     epevent.data.ptr = fd_ctx;
 
-    int rt = epoll_ctl(m_epfd, op, fd, &epevent);
+    int rt = epoll_ctl(fd_ctx->epfd, op, fd, &epevent);
     if(rt) {
-        EVA_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", "
+        EVA_LOG_ERROR(g_logger) << "epoll_ctl(" << fd_ctx->epfd << ", "
             << op << ", " << fd << ", " << (EPOLL_EVENTS)epevent.events << "):"
             << rt << " (" << errno << ") (" << strerror(errno) << ")";
         return false;
@@ -222,9 +230,9 @@ bool IOManager::scheduleEvent(epoll_event& event){
     int op = left_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
     event.events = EPOLLET | left_events;
 
-    int rt = epoll_ctl(m_epfd, op, fd_ctx->fd, &event);
+    int rt = epoll_ctl(fd_ctx->epfd, op, fd_ctx->fd, &event);
     if (rt) {
-        EVA_LOG_ERROR(g_logger) << "epoll_ctrl(" << m_epfd << ", " << op << ", " << fd_ctx->fd 
+        EVA_LOG_ERROR(g_logger) << "epoll_ctrl(" << fd_ctx->epfd << ", " << op << ", " << fd_ctx->fd 
             << ", " << (EPOLL_EVENTS)event.events << "), error: " << strerror(errno);
         return false;
     }
@@ -20,7 +20,9 @@ public:
         WRITE = 0x4,
     };
 
-    IOManager(int threads, const std::string& name = "iomanager");
+    // See Scheduler::ReactorMode for where fds are watched.
+    IOManager(int threads, const std::string& name = "iomanager",
+              ReactorMode mode = SHARED_REACTOR, bool use_caller = false);
     ~IOManager();
 private:
     struct FdContext {
@@ -43,7 +45,7 @@ private:
         };
 
         void resetContext(Event event) {
-            auto event_ctx = getContext(event);
+            auto& event_ctx = getContext(event);
             event_ctx.fiber = nullptr;
             event_ctx.func = nullptr;
             event_ctx.scheduler = nullptr;
@@ -52,23 +54,27 @@ private:
         void scheduleEvent(Event event) {
             ASSERT(events & event);
             events = (Event)(events & ~event);
-            auto event_ctx = getContext(event);
+            auto& event_ctx = getContext(event);
+            // IO completions go ahead of ordinary work
             if (event_ctx.func) {
-                event_ctx.scheduler->schedule(event_ctx.func);
+                event_ctx.scheduler->schedule(std::move(event_ctx.func), HIGH_PRIORITY);
             } 
             else if (event_ctx.fiber) {
-                event_ctx.scheduler->schedule(event_ctx.fiber);
+                event_ctx.scheduler->schedule(std::move(event_ctx.fiber), HIGH_PRIORITY);
             } else {
                 ASSERT(false); // either func or fiber must exist
             }
 
+            event_ctx.func = nullptr;
+            event_ctx.fiber = nullptr;
             event_ctx.scheduler = nullptr;
         }
 
         int fd = 0;
+        int epfd = -1; // the epoll watching fd while it has events
         EventContext read;
         EventContext write;
-        Event events;
+        Event events = NONE;
         Mutex mtx;
     };
 
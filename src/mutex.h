@@ -78,15 +78,16 @@ private:
     pthread_rwlock_t m_lock;
 };
 
-class MutexReadGuard {
+template <typename T>
+class ReadGuard {
 public:
-    MutexReadGuard(RWMutex& mtx) 
+    ReadGuard(T& mtx) 
         : m_mutex(mtx) {
         m_mutex.rdlock();
         m_locked = true;
     }
 
-    ~MutexReadGuard() {
+    ~ReadGuard() {
         unlock();
     }
 
@@ -105,18 +106,20 @@ public:
     }
 
 private:
-    RWMutex& m_mutex;
+    T& m_mutex;
     bool m_locked;
 };
 
-class MutexWriteGuard {
+template <typename T>
+class WriteGuard {
 public:
-    MutexWriteGuard(RWMutex& mtx) 
+    WriteGuard(T& mtx) 
         : m_mutex(mtx) {
         m_mutex.wrlock();
+        m_locked = true;
     };
 
-    ~MutexWriteGuard() {
+    ~WriteGuard() {
         unlock();
     }
     void lock() {
@@ -134,8 +137,11 @@ public:
     }
 
 private:
-    RWMutex& m_mutex;
+    T& m_mutex;
     bool m_locked;
 };
 
+using MutexReadGuard = ReadGuard<RWMutex>;
+using MutexWriteGuard = WriteGuard<RWMutex>;
+
 }
@@ -0,0 +1,58 @@
+#include "src/offload_pool.h"
+#include "src/macro.h"
+
+namespace eva01 {
+
+OffloadPool::OffloadPool(size_t threads, size_t capacity, const std::string& name)
+    : m_capacity(capacity), m_free(capacity) {
+    ASSERT(threads > 0 && capacity > 0);
+    for (size_t i = 0; i < threads; ++i) {
+        m_threads.emplace_back(new Thread(std::bind(&OffloadPool::run, this),
+                                          name + "_" + std::to_string(i)));
+    }
+}
+
+OffloadPool::~OffloadPool() {
+    {
+        MutexGuard<Mutex> lk(m_mutex);
+        m_stopping = true;
+    }
+    for (size_t i = 0; i < m_threads.size(); ++i) {
+        m_ready.notify();
+    }
+    for (auto& thread : m_threads) {
+        thread->join();
+    }
+}
+
+void OffloadPool::submit(InlineFunction job) {
+    m_free.wait();
+    {
+        MutexGuard<Mutex> lk(m_mutex);
+        ASSERT(!m_stopping);
+        m_jobs.push_back(std::move(job));
+        ++m_queued;
+    }
+    m_ready.notify();
+}
+
+void OffloadPool::run() {
+    while (true) {
+        m_ready.wait();
+        InlineFunction job;
+        {
+            MutexGuard<Mutex> lk(m_mutex);
+            if (m_jobs.empty()) {
+                return; // only a stop is left, each job has its own notify
+            }
+            job = std::move(m_jobs.front());
+            m_jobs.pop_front();
+            --m_queued;
+        }
+        m_free.notify();
+        job();
+        ++m_done;
+    }
+}
+
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include "src/fiber_sync.h"
+#include "src/inline_function.h"
+#include "src/mutex.h"
+#include "src/noncopyable.h"
+#include "src/semaphore.h"
+#include "src/thread.h"
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace eva01 {
+
+// Plain threads, without hooks, for calls that would block a scheduler
+// worker, see Scheduler::offload(). At most capacity jobs wait for a
+// thread; submit() parks the calling fiber while the queue is full.
+class OffloadPool : public NonCopyable {
+public:
+    using ptr = std::shared_ptr<OffloadPool>;
+
+    OffloadPool(size_t threads, size_t capacity, const std::string& name = "offload");
+    // Runs the queued jobs and joins the threads.
+    ~OffloadPool();
+
+    void submit(InlineFunction job);
+
+    size_t getThreadCount() const { return m_threads.size(); }
+    size_t getCapacity() const { return m_capacity; }
+    // Jobs waiting for a thread, and jobs run so far.
+    size_t getQueueSize() const { return m_queued; }
+    uint64_t getDoneCount() const { return m_done; }
+
+private:
+    void run();
+
+private:
+    Mutex m_mutex;
+    std::deque<InlineFunction> m_jobs;
+    bool m_stopping = false;
+    size_t m_capacity;
+    Semaphore m_ready;      // once per job, and per thread to stop
+    FiberSemaphore m_free;  // free places in m_jobs
+    std::vector<Thread::ptr> m_threads;
+    std::atomic<size_t> m_queued { 0 };
+    std::atomic<uint64_t> m_done { 0 };
+};
+
+}
@@ -5,11 +5,22 @@
 #include "src/thread.h"
 #include "src/timer.h"
 #include "src/hook.h"
+#include "src/stack_allocator.h"
+#include "src/work_stealing_queue.h"
 
 #include <bits/stdint-uintn.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <iterator>
+#include <algorithm>
+#include <deque>
 #include <sys/epoll.h>
 #include <string.h>
+#include <sstream>
+#include <chrono>
+#include <sched.h>
 
 namespace eva01 {
 
@@ -17,32 +28,246 @@ static Logger::ptr g_logger = EVA_LOGGER("system");
 
 static thread_local Scheduler* t_scheduler = nullptr;
 static thread_local Fiber* t_fiber = nullptr;
+static thread_local size_t t_worker_index = 0; // of t_scheduler
+static thread_local Fiber::ptr t_lifo_fiber = nullptr; // see scheduleNext()
+static thread_local size_t t_lifo_runs = 0;
+static thread_local bool t_own_events = false; // scheduling the events of the worker's epoll
 
 constexpr const int MAX_EVENTS = 256;
 constexpr const int EPOLL_WAIT_TIMEOUT_MS = 3000;
+constexpr const size_t MAX_POOLED_FIBERS = 32;
+constexpr const size_t MAX_LIFO_RUNS = 16;
+constexpr const size_t LOCAL_QUEUE_SIZE = 256;
+constexpr const uint32_t INJECT_CHECK_INTERVAL = 61; // see dequeue()
+constexpr const size_t MAX_DEQUEUE_BATCH = LOCAL_QUEUE_SIZE / 2;
 
-Scheduler::Scheduler(int threads, const std::string& name) 
-    : m_name(name) {
+constexpr const size_t MAX_CACHED_TASKS = 1024;
+constexpr const size_t DEFAULT_OFFLOAD_THREADS = 4;
+
+// Freed task nodes of a thread, handed out again to tasks it schedules.
+// Most tasks are scheduled by workers, which also free the ones they run.
+struct TaskCache {
+    void* head = nullptr;
+    size_t size = 0;
+
+    ~TaskCache() {
+        while (head) {
+            void* next = *static_cast<void**>(head);
+            ::operator delete(head);
+            head = next;
+        }
+    }
+};
+
+static thread_local TaskCache t_task_cache;
+
+static uint64_t NowUs() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void* Scheduler::Task::operator new(size_t size) {
+    TaskCache& cache = t_task_cache;
+    if (cache.head) {
+        void* ptr = cache.head;
+        cache.head = *static_cast<void**>(ptr);
+        --cache.size;
+        return ptr;
+    }
+    return ::operator new(size);
+}
+
+void Scheduler::Task::operator delete(void* ptr) {
+    TaskCache& cache = t_task_cache;
+    if (cache.size >= MAX_CACHED_TASKS) {
+        ::operator delete(ptr);
+        return;
+    }
+    *static_cast<void**>(ptr) = cache.head;
+    cache.head = ptr;
+    ++cache.size;
+}
+
+// A FIFO of tasks linked through Task::next.
+struct Scheduler::Lane {
+    Mutex mutex;
+    Task* head = nullptr;
+    Task* tail = nullptr;
+    std::atomic<size_t> size { 0 };
+
+    // true if the lane was empty.
+    bool push(Task* task) {
+        MutexGuard<Mutex> lk(mutex);
+        task->next = nullptr;
+        if (tail) {
+            tail->next = task;
+        } else {
+            head = task;
+        }
+        tail = task;
+        ++size;
+        return head == task;
+    }
+
+    // The first task that may run on thread, nullptr if there is none.
+    Task* pop(pid_t thread) {
+        Task* task = nullptr;
+        pop(thread, &task, 1);
+        return task;
+    }
+
+    // Up to max tasks in order into out under one lock, the number taken.
+    // The first one may run on thread, the others on any thread.
+    size_t pop(pid_t thread, Task** out, size_t max) {
+        if (!size) {
+            return 0;
+        }
+        MutexGuard<Mutex> lk(mutex);
+        size_t n = 0;
+        Task* prev = nullptr;
+        for (Task* task = head; task && n < max; ) {
+            Task* next = task->next;
+            // Skip the task, if task is assigned to a thread outside of this scheduler
+            if (task->thread_id != -1 && (n || task->thread_id != thread)) {
+                prev = task;
+                task = next;
+                continue;
+            }
+            (prev ? prev->next : head) = next;
+            if (tail == task) {
+                tail = prev;
+            }
+            task->next = nullptr;
+            out[n++] = task;
+            task = next;
+        }
+        size -= n;
+        return n;
+    }
+
+    // All tasks, linked through next, and the lane is empty.
+    Task* takeAll() {
+        MutexGuard<Mutex> lk(mutex);
+        Task* task = head;
+        head = tail = nullptr;
+        size = 0;
+        return task;
+    }
+
+    // The oldest task that holds a place in the queues, nullptr if there is
+    // none, see Scheduler::admit().
+    Task* popBounded() {
+        if (!size) {
+            return nullptr;
+        }
+        MutexGuard<Mutex> lk(mutex);
+        Task* prev = nullptr;
+        for (Task* task = head; task; prev = task, task = task->next) {
+            if (!task->bounded) {
+                continue;
+            }
+            (prev ? prev->next : head) = task->next;
+            if (tail == task) {
+                tail = prev;
+            }
+            task->next = nullptr;
+            --size;
+            return task;
+        }
+        return nullptr;
+    }
+
+    ~Lane() {
+        while (Task* task = head) {
+            head = task->next;
+            delete task;
+        }
+    }
+};
+
+struct Scheduler::Worker {
+    WorkStealingQueue<Task, LOCAL_QUEUE_SIZE> queue;
+    uint32_t tick = 0;
+    uint32_t lane_tick = 0; // for picking the first lane, see dequeue()
+    uint64_t gap_us = 0;    // average idle time, see noteIdleGap()
+    uint64_t spin_budget_us = ~0ull;
+    uint32_t seed = 0; // for picking steal victims
+    std::atomic<pid_t> thread_id { 0 };
+
+    // Tasks that may only run on this worker, never stolen. They are taken
+    // over to pinned_batch in batches, which only the worker looks at.
+    Mutex pinned_mutex;
+    std::deque<Task*> pinned;
+    std::atomic<size_t> pinned_count { 0 };
+    std::deque<Task*> pinned_batch;
+
+    // A sleeping worker blocks in a read of wake_fd, see idle(), or in
+    // epfd when it has an epoll of its own.
+    int wake_fd = -1;
+    int epfd = -1;
+    std::atomic<bool> notified { false }; // wake_fd written, not read yet
+    bool sleeping = false;                // on m_sleeping, guarded by m_sleep_mutex
+
+    // Odd while the worker runs a task, see checkTimeSlices(). The monitor
+    // remembers the last one it saw and since when.
+    std::atomic<uint64_t> task_seq { 0 };
+    uint64_t seen_seq = 0;
+    uint64_t seen_ms = 0;
+    std::atomic<int> yield_request { Fiber::NO_YIELD }; // see Fiber::MaybeYield()
+
+    bool elastic = false; // may retire, see setElasticPool()
+    bool active = false;  // the slot has a thread or grow() starts one, guarded by m_mutex
+
+    // See getStats(). All but tickles are only written by the worker.
+    std::atomic<uint64_t> tasks_run { 0 };
+    std::atomic<uint64_t> fibers_resumed { 0 };
+    std::atomic<uint64_t> steals { 0 };
+    std::atomic<uint64_t> tickles { 0 };
+    std::atomic<uint64_t> epoll_wakeups { 0 };
+    std::atomic<uint64_t> idle_us { 0 };
+    std::atomic<uint64_t> idle_since_us { 0 }; // 0 while not idle
+    HistogramRecorder wait_us;
+    HistogramRecorder run_us;
+
+    // Add to a counter only this worker writes, without a locked instruction.
+    static void Bump(std::atomic<uint64_t>& counter, uint64_t n = 1) {
+        counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+};
+
+Scheduler::Scheduler(int threads, const std::string& name, bool use_caller) 
+    : m_name(name), m_use_caller(use_caller) {
     ASSERT(threads > 0);
 
     //initialize threads
     Thread::SetName(m_name);
     m_root_thread = GetThreadId();
     m_thread_count = threads;
+    m_min_threads = threads;
+    m_max_threads = threads;
+    m_offload_threads = DEFAULT_OFFLOAD_THREADS;
+
+    static const uint32_t default_weights[PRIORITY_COUNT] = { 8, 4, 1 };
+    for (int i = 0; i < PRIORITY_COUNT; ++i) {
+        m_lanes[i].reset(new Lane);
+        m_weights[i] = default_weights[i];
+        m_depth[i] = 0;
+    }
 
     //initialize epoll fd
     m_epfd = epoll_create(5000);
     ASSERT(m_epfd > 0);
 
-    ASSERT(!pipe(m_tickle_fds));
-    ASSERT(!fcntl(m_tickle_fds[0], F_SETFL, O_NONBLOCK));
+    // wakes the worker that waits in epoll, see wakePoller()
+    m_tickle_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    ASSERT(m_tickle_fd >= 0);
 
     epoll_event event;
     memset(&event, 0, sizeof(epoll_event));
     event.events = EPOLLIN | EPOLLET;
-    event.data.fd = m_tickle_fds[0];
+    event.data.ptr = nullptr; // IO events carry their FdContext
 
-    ASSERT(!epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_tickle_fds[0], &event));
+    ASSERT(!epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_tickle_fd, &event));
 }
 
 Scheduler::~Scheduler() {
@@ -50,8 +275,7 @@ Scheduler::~Scheduler() {
     ASSERT(!m_stopping);
     ASSERT(m_stopped);
     close(m_epfd);
-    close(m_tickle_fds[0]);
-    close(m_tickle_fds[1]);
+    close(m_tickle_fd);
 }
 
 void Scheduler::start() {
@@ -59,17 +283,477 @@ void Scheduler::start() {
 
     if (m_stopping) { return; }
     m_stopped = false;
+    m_force_stop = false;
 
     ASSERT(m_threads.empty());
-    m_threads.resize(m_thread_count);
-    for (size_t i = 0; i < m_thread_count; ++i) {
+    m_workers.resize(m_max_threads);
+    // Slots the pool may grow into are there from the start, so the workers
+    // can look at each other without a lock.
+    for (size_t i = m_thread_count; i < m_max_threads; ++i) {
+        m_workers[i].reset(createWorker(i));
+    }
+
+    // The caller is the last worker, it runs the loop in stop() or runInCaller().
+    size_t spawned = m_thread_count;
+    if (m_use_caller) {
+        ASSERT(GetThreadId() == m_root_thread);
+        --spawned;
+        if (!m_cpu_sets.empty()) {
+            Thread::SetAffinity(m_cpu_sets[spawned % m_cpu_sets.size()]);
+        }
+        m_workers[spawned].reset(createWorker(spawned));
+        m_workers[spawned]->thread_id = GetThreadId();
+        logPlacement(*m_workers[spawned], spawned);
+    }
+
+    m_threads.resize(m_max_threads); // none for the caller
+    for (size_t i = 0; i < spawned; ++i) {
+        std::vector<int> cpus;
+        if (!m_cpu_sets.empty()) {
+            cpus = m_cpu_sets[i % m_cpu_sets.size()];
+        }
         m_threads[i].reset(new Thread(
-                    std::bind(&Scheduler::run, this), 
-                    m_name + "_" + std::to_string(i)));
+                    std::bind(&Scheduler::threadMain, this, i), 
+                    m_name + "_" + std::to_string(i), cpus));
+    }
+
+    // Every worker creates its own structures, see threadMain(). None may
+    // look at the others before all are there.
+    for (size_t i = 0; i < spawned; ++i) {
+        m_workers_ready.wait();
+    }
+    for (size_t i = 0; i < spawned; ++i) {
+        m_workers_go.notify();
+    }
+
+    for (size_t i = 0; i < m_thread_count; ++i) {
+        m_workers[i]->active = true;
+    }
+    m_running_threads = m_thread_count;
+    if (m_max_threads > m_min_threads || m_time_slice_ms) {
+        m_monitor.reset(new Thread(std::bind(&Scheduler::monitor, this), m_name + "_monitor"));
     }
 }
 
-void Scheduler::stop() {
+void Scheduler::setReactorMode(ReactorMode mode) {
+    MutexGuard<MutexType> lock(m_mutex);
+    ASSERT(m_stopped);
+    m_reactor_mode = mode;
+}
+
+int Scheduler::pickEpoll() {
+    if (m_reactor_mode == SHARED_REACTOR) {
+        return m_epfd;
+    }
+    if (m_reactor_mode == CALLER_REACTOR && t_scheduler == this &&
+        !m_workers[t_worker_index]->elastic) {
+        return m_workers[t_worker_index]->epfd;
+    }
+    size_t count = m_workers.size();
+    if (!count) {
+        return -1; // stopped, see join()
+    }
+    // A worker that may retire cannot keep fds, and the caller only polls
+    // from stop() or runInCaller(): it gets them only when it is alone.
+    for (size_t i = 0; i < count; ++i) {
+        Worker* worker = m_workers[m_next_reactor++ % count].get();
+        if (!worker->elastic && !(m_use_caller && worker == m_workers[m_thread_count - 1].get())) {
+            return worker->epfd;
+        }
+    }
+    return m_workers[m_thread_count - 1]->epfd;
+}
+
+void Scheduler::setCpuAffinity(std::vector<std::vector<int>> cpu_sets) {
+    MutexGuard<MutexType> lock(m_mutex);
+    ASSERT(m_stopped);
+    m_cpu_sets = std::move(cpu_sets);
+}
+
+Scheduler::Worker* Scheduler::createWorker(size_t index) {
+    // The core workers are allocated by their own thread, already pinned, so
+    // the pages of their queues are first touched on their NUMA node. The
+    // elastic slots are allocated up front by start() on the caller thread
+    // and may live elsewhere.
+    Worker* worker = new Worker;
+    worker->seed = index + 1;
+    worker->elastic = isElastic(index);
+    worker->wake_fd = eventfd(0, EFD_CLOEXEC);
+    ASSERT(worker->wake_fd >= 0);
+    if (m_reactor_mode != SHARED_REACTOR) {
+        worker->epfd = epoll_create1(EPOLL_CLOEXEC);
+        ASSERT(worker->epfd >= 0);
+
+        epoll_event event;
+        memset(&event, 0, sizeof(epoll_event));
+        event.events = EPOLLIN | EPOLLET;
+        event.data.ptr = nullptr; // IO events carry their FdContext
+        ASSERT(!epoll_ctl(worker->epfd, EPOLL_CTL_ADD, worker->wake_fd, &event));
+    }
+    return worker;
+}
+
+void Scheduler::logPlacement(Worker& worker, size_t index) {
+    if (!m_cpu_sets.empty()) {
+        std::stringstream ss;
+        for (int cpu : Thread::GetAffinity()) {
+            ss << (ss.tellp() ? "," : "") << cpu;
+        }
+        EVA_LOG_INFO(g_logger) << "Scheduler name=" << getName() << " worker " << index
+            << " thread=" << worker.thread_id << " cpus=" << ss.str()
+            << " cpu=" << Thread::GetCpu() << " node=" << Thread::GetNumaNode();
+    }
+}
+
+bool Scheduler::isElastic(size_t index) const {
+    return index >= m_min_threads && !(m_use_caller && index == m_thread_count - 1);
+}
+
+void Scheduler::setElasticPool(size_t min_threads, size_t max_threads,
+                               uint64_t latency_ms, uint64_t idle_ms) {
+    MutexGuard<MutexType> lock(m_mutex);
+    ASSERT(m_stopped);
+    ASSERT(min_threads > 0 && min_threads <= m_thread_count && m_thread_count <= max_threads);
+    m_min_threads = min_threads;
+    m_max_threads = max_threads;
+    m_grow_latency_ms = latency_ms;
+    m_retire_idle_ms = idle_ms;
+}
+
+void Scheduler::monitor() {
+    // Often enough for the pool and for the time slices.
+    bool elastic = m_max_threads > m_min_threads;
+    uint64_t interval = ~0ull;
+    if (elastic) {
+        interval = std::max<uint64_t>(m_grow_latency_ms / 2, 1);
+    }
+    if (m_time_slice_ms) {
+        interval = std::min(interval, std::max<uint64_t>(m_time_slice_ms / 2, 1));
+    }
+
+    uint64_t last_taken = 0;
+    uint64_t stalled = 0;
+    size_t over = 0;
+    while (!m_monitor_stop.waitFor(interval)) {
+        if (m_time_slice_ms) {
+            checkTimeSlices();
+        }
+        if (!elastic) {
+            continue;
+        }
+
+        // Little's law: the queued tasks over the rate they are taken at.
+        // Read before the count of all tasks, which never lags behind it.
+        size_t queued = m_queued;
+        uint64_t taken = m_scheduled_count - queued;
+        uint64_t rate = taken > last_taken ? taken - last_taken : 0;
+        last_taken = std::max(taken, last_taken);
+
+        uint64_t latency = 0;
+        stalled = queued && !rate ? stalled + interval : 0;
+        if (queued) {
+            latency = rate ? queued * interval / rate : stalled;
+        }
+        m_queue_latency_ms = latency;
+
+        // Above the threshold for two samples in a row, and nobody idle
+        // who could take the tasks.
+        over = latency > m_grow_latency_ms ? over + 1 : 0;
+        if (over >= 2 && !m_idle_threads) {
+            grow();
+            over = 0;
+        }
+    }
+}
+
+void Scheduler::checkTimeSlices() {
+    uint64_t now = GetCurrentMs();
+    for (auto& worker : m_workers) {
+        uint64_t seq = worker->task_seq;
+        if (!(seq & 1)) {
+            continue; // between tasks
+        }
+        if (seq != worker->seen_seq) {
+            worker->seen_seq = seq;
+            worker->seen_ms = now;
+            continue;
+        }
+        // The same task for a whole slice. Asked once, it yields at its
+        // next Fiber::MaybeYield().
+        int none = Fiber::NO_YIELD;
+        if (now - worker->seen_ms >= m_time_slice_ms &&
+            worker->yield_request.compare_exchange_strong(none, Fiber::YIELD_REQUESTED)) {
+            ++m_preempt_requests;
+        }
+    }
+}
+
+void Scheduler::beginSlice(Worker& worker) {
+    if (m_time_slice_ms) {
+        worker.yield_request = Fiber::NO_YIELD;
+        ++worker.task_seq;
+    }
+}
+
+bool Scheduler::endSlice(Worker& worker) {
+    if (m_time_slice_ms) {
+        ++worker.task_seq;
+        if (worker.yield_request.exchange(Fiber::NO_YIELD) == Fiber::YIELDED) {
+            ++m_preempt_count;
+            return true;
+        }
+    }
+    return false;
+}
+
+void Scheduler::reschedule(Fiber::ptr&& fiber, Priority prio, int thread_id, bool preempted) {
+    if (enqueue(new Task(std::move(fiber), thread_id, 0, prio), preempted)) {
+        tickle();
+    }
+}
+
+void Scheduler::setTimeSlice(uint64_t slice_ms) {
+    MutexGuard<MutexType> lock(m_mutex);
+    ASSERT(m_stopped);
+    m_time_slice_ms = slice_ms;
+}
+
+void Scheduler::setQueueCapacity(size_t capacity, QueuePolicy policy) {
+    MutexGuard<MutexType> lock(m_mutex);
+    ASSERT(m_stopped && !m_queued);
+    m_capacity = capacity;
+    m_queue_policy = policy;
+    m_room.reset(capacity ? new FiberSemaphore(capacity) : nullptr);
+}
+
+void Scheduler::setSojournTarget(uint64_t target_ms, uint64_t interval_ms) {
+    MutexGuard<MutexType> lock(m_mutex);
+    ASSERT(m_stopped);
+    m_sojourn_target_us = target_ms * 1000;
+    m_sojourn_interval_us = interval_ms * 1000;
+    m_above_target_since = 0;
+    m_overloaded = false;
+}
+
+bool Scheduler::isOverloaded() {
+    // Nothing is taken once the queues are empty, so nothing clears it then.
+    if (m_overloaded && !m_depth[NORMAL_PRIORITY] && !m_depth[BACKGROUND_PRIORITY]) {
+        m_above_target_since = 0;
+        m_overloaded = false;
+    }
+    return m_overloaded;
+}
+
+bool Scheduler::admit(Task* task) {
+    if (!task->func || task->priority == HIGH_PRIORITY) {
+        return true;
+    }
+    if (m_closed) {
+        ++m_rejected_count; // stopping, see stop(deadline_ms)
+        return false;
+    }
+    if (m_sojourn_target_us && isOverloaded()) {
+        ++m_shed_count;
+        return false;
+    }
+    if (m_room && !m_room->tryWait() && !makeRoom()) {
+        ++m_rejected_count;
+        return false;
+    }
+    task->bounded = (bool)m_room;
+    if (m_sojourn_target_us) {
+        task->enqueued_us = NowUs();
+    }
+    return true;
+}
+
+bool Scheduler::makeRoom() {
+    switch (m_queue_policy) {
+    case BLOCK_WHEN_FULL:
+        ++m_blocked_count;
+        m_room->wait();
+        return true;
+    case DROP_OLDEST:
+        // The new task takes over the place of the old one.
+        for (Priority prio : { BACKGROUND_PRIORITY, NORMAL_PRIORITY }) {
+            if (Task* old = m_lanes[prio]->popBounded()) {
+                --m_queued;
+                --m_depth[prio];
+                ++m_dropped_count;
+                delete old; // fails its Future, if any
+                return true;
+            }
+        }
+        return false; // all of them in the run queues
+    case REJECT_WHEN_FULL:
+        break;
+    }
+    return false;
+}
+
+void Scheduler::release(Task& task) {
+    if (task.bounded) {
+        m_room->notify();
+    }
+    // Only new work counts, see setSojournTarget(); fibers may be stamped
+    // for the stats.
+    if (!task.func || !task.enqueued_us || !m_sojourn_target_us) {
+        return;
+    }
+    uint64_t now = NowUs();
+    if (now - task.enqueued_us < m_sojourn_target_us) {
+        m_above_target_since = 0;
+        m_overloaded = false;
+        return;
+    }
+    uint64_t since = m_above_target_since;
+    if (!since) {
+        m_above_target_since.compare_exchange_strong(since, now);
+    } else if (now - since >= m_sojourn_interval_us) {
+        m_overloaded = true;
+    }
+}
+
+void Scheduler::grow() {
+    size_t index = 0;
+    Thread::ptr retired;
+    {
+        // Not while stopping, join() takes the threads as they are then.
+        MutexGuard<MutexType> lock(m_mutex);
+        if (m_stopping || m_running_threads >= m_max_threads) {
+            return;
+        }
+        while (m_workers[index]->active) {
+            ++index;
+        }
+        m_workers[index]->active = true;
+        ++m_running_threads;
+        // The thread that had the slot has retired, it is gone or about to be.
+        retired = std::move(m_threads[index]);
+    }
+    // Joined unlocked, the workers keep looking at the scheduler meanwhile.
+    if (retired) {
+        retired->join();
+    }
+
+    MutexGuard<MutexType> lock(m_mutex);
+    if (m_stopping) {
+        m_workers[index]->active = false;
+        --m_running_threads;
+        return;
+    }
+    ++m_grow_count;
+    std::vector<int> cpus;
+    if (!m_cpu_sets.empty()) {
+        cpus = m_cpu_sets[index % m_cpu_sets.size()];
+    }
+    m_threads[index].reset(new Thread(
+                std::bind(&Scheduler::growMain, this, index),
+                m_name + "_" + std::to_string(index), cpus));
+}
+
+bool Scheduler::retire(Worker& worker, bool sleeping) {
+    MutexGuard<Mutex> lk(m_sleep_mutex);
+    if (worker.sleeping != sleeping) {
+        return false; // its wake-up is on the way
+    }
+    {
+        MutexGuard<MutexType> lock(m_mutex);
+        if (m_stopping || m_running_threads <= m_min_threads) {
+            return false;
+        }
+        // A suspended shared stack fiber can only resume on this thread. Runs
+        // on it, so no fiber gets bound meanwhile.
+        if (Fiber::GetBoundCount()) {
+            return false;
+        }
+        MutexGuard<Mutex> pinned_lk(worker.pinned_mutex);
+        if (!worker.pinned.empty()) {
+            return false;
+        }
+        // enqueue() does not pin tasks to it any more.
+        worker.thread_id = 0;
+        worker.active = false;
+        --m_running_threads;
+    }
+    if (sleeping) {
+        m_sleeping.erase(std::find(m_sleeping.begin(), m_sleeping.end(), &worker));
+        worker.sleeping = false;
+        --m_sleeping_count;
+    }
+    ++m_retire_count;
+    EVA_LOG_INFO(g_logger) << "Scheduler name=" << getName() << " retired worker "
+        << t_worker_index << " threads=" << m_running_threads;
+    return true;
+}
+
+void Scheduler::setIdlePolicy(uint64_t spin_us, uint64_t yield_us, bool adaptive) {
+    m_spin_us = spin_us;
+    m_yield_us = yield_us;
+    m_adaptive_spin = adaptive;
+}
+
+void Scheduler::setOffloadPool(size_t threads, size_t capacity) {
+    MutexGuard<MutexType> lock(m_mutex);
+    ASSERT(!m_offload);
+    m_offload_threads = threads;
+    m_offload_capacity = capacity;
+}
+
+OffloadPool::ptr Scheduler::getOffloadPool() {
+    MutexGuard<MutexType> lock(m_mutex);
+    if (!m_offload) {
+        m_offload.reset(new OffloadPool(m_offload_threads, m_offload_capacity,
+                                        m_name + "_offload"));
+    }
+    return m_offload;
+}
+
+void Scheduler::setPriorityWeight(Priority prio, uint32_t weight) {
+    ASSERT(prio < PRIORITY_COUNT && weight > 0);
+    m_weights[prio] = weight;
+}
+
+std::vector<pid_t> Scheduler::getThreadIds() const {
+    std::vector<pid_t> ids;
+    for (auto& worker : m_workers) {
+        if (worker->thread_id) {
+            ids.push_back(worker->thread_id);
+        }
+    }
+    return ids;
+}
+
+Scheduler::Stats Scheduler::getStats() {
+    Stats stats;
+    uint64_t now = NowUs();
+    MutexGuard<MutexType> lock(m_mutex); // the workers go away in join()
+    for (auto& worker : m_workers) {
+        if (!worker) {
+            continue; // still starting
+        }
+        WorkerStats ws;
+        ws.thread_id = worker->thread_id;
+        ws.tasks_run = worker->tasks_run;
+        ws.fibers_resumed = worker->fibers_resumed;
+        ws.steals = worker->steals;
+        ws.tickles = worker->tickles;
+        ws.epoll_wakeups = worker->epoll_wakeups;
+        uint64_t idle_since = worker->idle_since_us;
+        ws.idle_us = worker->idle_us + (idle_since && now > idle_since ? now - idle_since : 0);
+        stats.workers.push_back(ws);
+        worker->wait_us.addTo(stats.wait_us);
+        worker->run_us.addTo(stats.run_us);
+    }
+    for (int i = 0; i < PRIORITY_COUNT; ++i) {
+        stats.queue_depth[i] = m_depth[i];
+    }
+    stats.scheduled = m_scheduled_count;
+    stats.wakeups = m_wakeup_count;
+    return stats;
+}
+
+void Scheduler::beginStop() {
     EVA_LOG_DEBUG(g_logger) << "name=" << getName() << " stopping";
     {
         MutexGuard<MutexType> lk(m_mutex);
@@ -78,55 +762,228 @@ void Scheduler::stop() {
     }
 
     // Wake up all threads to catch up the new m_stopping flag.
-    for (size_t i = 0; i < m_thread_count; ++i) {
-        tickle();
+    wakeAll();
+}
+
+void Scheduler::stop() {
+    {
+        MutexGuard<MutexType> lk(m_mutex);
+        if (m_stopped) {
+            return; // not started, or stopped already, e.g. before the destructor
+        }
+    }
+    beginStop();
+    if (m_use_caller) {
+        // runInCaller() finishes the stop once the loop is done.
+        if (m_caller_running) {
+            return;
+        }
+        ASSERT(GetThreadId() == m_root_thread);
+        run(m_thread_count - 1); // until all work is done
+    }
+    join();
+}
+
+Scheduler::StopReport Scheduler::stop(uint64_t deadline_ms, TimerPolicy timers) {
+    ASSERT(t_scheduler != this && !m_caller_running);
+    StopReport report;
+    uint64_t start_ms = GetCurrentMs();
+    m_closed = true;
+    if (timers != WAIT_TIMERS) {
+        std::vector<std::function<void()>> funcs;
+        report.timers = clearTimers(timers == FIRE_TIMERS ? &funcs : nullptr);
+        schedule(funcs.begin(), funcs.end(), HIGH_PRIORITY);
+    }
+
+    // Joined in join() once the workers are gone, so it never sees them go.
+    m_stop_watchdog.reset(new Thread([this, deadline_ms]() {
+        if (!m_stop_done.waitFor(deadline_ms)) {
+            forceStop();
+            m_stop_done.wait();
+        }
+    }, m_name + "_stop"));
+    beginStop();
+    if (m_use_caller) {
+        ASSERT(GetThreadId() == m_root_thread);
+        run(m_thread_count - 1); // until all work is done, or the deadline
+    }
+    report.dropped_tasks = join();
+    if (m_force_stop) {
+        report.drained = false;
+        report.dropped_timers = clearTimers();
+    }
+    report.elapsed_ms = GetCurrentMs() - start_ms;
+    EVA_LOG_INFO(g_logger) << "Scheduler name=" << getName() << " stopped in "
+        << report.elapsed_ms << "ms drained=" << report.drained
+        << " dropped_tasks=" << report.dropped_tasks
+        << " dropped_timers=" << report.dropped_timers;
+    return report;
+}
+
+void Scheduler::forceStop() {
+    m_force_stop = true;
+    // A running task goes no further than its next Fiber::MaybeYield().
+    for (auto& worker : m_workers) {
+        worker->yield_request = Fiber::YIELD_REQUESTED;
+    }
+    wakeAll();
+}
+
+void Scheduler::runInCaller() {
+    ASSERT(m_use_caller && GetThreadId() == m_root_thread);
+    ASSERT(!m_stopped && !m_caller_running);
+    m_caller_running = true;
+    run(m_thread_count - 1); // until stop() is called and all work is done
+    m_caller_running = false;
+    join();
+}
+
+size_t Scheduler::join() {
+    // Join all threads. The monitor adds no more once stopping, and still
+    // watches the time slices until all work is done.
+    std::vector<Thread::ptr> threads;
+    {
+        MutexGuard<MutexType> lk(m_mutex);
+        threads = m_threads;
+    }
+    for (auto& it : threads) {
+        if (it) {
+            it->join();
+        }
+    }
+    if (m_stop_watchdog) {
+        m_stop_done.notify();
+        m_stop_watchdog->join();
+        m_stop_watchdog.reset();
+    }
+    if (m_monitor) {
+        m_monitor_stop.notify();
+        m_monitor->join();
+        m_monitor.reset();
     }
 
-    // Join all threads.
-    for (auto& it : m_threads) {
-        it->join();
+    // After a forced stop offloaded jobs may still wake their fibers: the
+    // pool goes before the queues are emptied, so those are dropped with
+    // the rest. Joined unlocked, its threads may be in a blocking call.
+    OffloadPool::ptr offload;
+    {
+        MutexGuard<MutexType> lk(m_mutex);
+        offload = std::move(m_offload);
+    }
+    offload.reset();
+
+    // Still read by schedule() from other threads.
+    {
+        MutexGuard<Mutex> lk(m_sleep_mutex);
+        for (Worker* worker : m_sleeping) {
+            worker->sleeping = false;
+        }
+        m_sleeping.clear();
+        m_sleeping_count = 0;
     }
 
+    size_t dropped = 0;
     {
         MutexGuard<MutexType> lk(m_mutex);
         m_threads.clear();
+        auto drop = [this, &dropped](Task* task) {
+            --m_queued;
+            --m_depth[task->priority];
+            release(*task);
+            delete task;
+            ++dropped;
+        };
+        // Whatever is left was pinned to a thread that quit first, or was
+        // not done by the deadline of stop().
+        for (auto& worker : m_workers) {
+            while (Task* task = worker->queue.pop()) {
+                drop(task);
+            }
+            worker->pinned_batch.insert(worker->pinned_batch.end(),
+                                        worker->pinned.begin(), worker->pinned.end());
+            for (auto task : worker->pinned_batch) {
+                drop(task);
+            }
+            close(worker->wake_fd);
+            if (worker->epfd >= 0) {
+                close(worker->epfd);
+            }
+        }
+        m_workers.clear();
+        if (m_force_stop) {
+            for (auto& lane : m_lanes) {
+                for (Task* task = lane->takeAll(); task; ) {
+                    Task* next = task->next;
+                    drop(task);
+                    task = next;
+                }
+            }
+        }
         m_stopping = false;
         m_stopped = true;
         m_auto_stop = false;
+        m_closed = false;
     }
+    return dropped;
 }
 
-void Scheduler::run() {
+void Scheduler::threadMain(size_t index) {
+    Worker* worker = createWorker(index);
+    worker->thread_id = GetThreadId();
+    m_workers[index].reset(worker);
+    logPlacement(*worker, index);
+    m_workers_ready.notify();
+    m_workers_go.wait();
+    run(index);
+}
+
+void Scheduler::growMain(size_t index) {
+    Worker& worker = *m_workers[index];
+    worker.thread_id = GetThreadId();
+    logPlacement(worker, index);
+    EVA_LOG_INFO(g_logger) << "Scheduler name=" << getName() << " added worker "
+        << index << " threads=" << m_running_threads;
+    run(index);
+}
+
+void Scheduler::run(size_t index) {
     t_fiber = Fiber::GetThis().get(); // initialize main fiber in this thread.
     t_scheduler = this;
+    t_worker_index = index;
     set_hook(true);
 
+    Worker& worker = *m_workers[index];
+    Fiber::SetYieldRequest(&worker.yield_request);
     Fiber::ptr idle_fiber(new Fiber(std::bind(&Scheduler::idle, this))); // idle fiber for waiting on the task
-    Fiber::ptr func_fiber; // fiber to do the task
+    std::vector<Fiber::ptr> fiber_pool; // terminated fibers of this thread, reused for function tasks
+    fiber_pool.reserve(MAX_POOLED_FIBERS);
     Task tk; // to register the next task, avoid creating a new task each loop.
 
     while (true) {
         tk.reset();
-        bool need_tickle = false;
+        Task* task = nullptr;
 
-        // find out todo task
-        {
-            MutexGuard<MutexType> lk(m_mutex);
-            auto it = m_tasks.begin();
-            while (it != m_tasks.end()) {
-                // Skip the task, if task is assigned to a specific thread
-                if (it->thread_id != -1 && it->thread_id != GetThreadId()) {
-                    continue;
-                }
+        // A fiber woken by scheduleNext() runs ahead of the queue, unless it
+        // has done so too often in a row.
+        if (t_lifo_fiber && t_lifo_runs < MAX_LIFO_RUNS && !m_force_stop) {
+            ++t_lifo_runs;
+            tk.fiber = std::move(t_lifo_fiber);
+        } else if (t_lifo_fiber) {
+            t_lifo_runs = 0;
+            schedule(std::move(t_lifo_fiber));
+        } else {
+            t_lifo_runs = 0;
+        }
 
-                ASSERT((it->fiber && it->fiber->getState() != Fiber::RUNNING) || 
-                        it->func);
-                
-                tk = std::move(*it);
-                m_tasks.erase(it);
-                break;
+        // find out todo task
+        // Past the deadline of stop() the rest is left undone.
+        if (!tk.fiber && !m_force_stop) {
+            task = dequeue(worker);
+            if (task) {
+                tk = std::move(*task);
+                delete task;
+                ASSERT((tk.fiber && tk.fiber->getState() != Fiber::RUNNING) || tk.func);
             }
-            need_tickle = !m_tasks.empty();
         }
 
         // This thread will be working, m_active_threads has to be increased before tickle()
@@ -136,69 +993,393 @@ void Scheduler::run() {
         if (tk.fiber || tk.func) {
             ++m_active_threads;            
         }
-
-        // If there is still tasks in queue,
-        // wakeup the others threads
-        if (need_tickle) {
-            tickle();
+        // Only counted as taken once active, see shouldStop().
+        if (task) {
+            --m_queued;
+            --m_depth[tk.priority];
+            release(tk);
+            if (tk.enqueued_us && m_stats_enabled) {
+                worker.wait_us.add(NowUs() - tk.enqueued_us);
+            }
+            // Bring in another worker while there is work for it, or when
+            // nobody is left to wait for IO and timers.
+            if (m_sleeping_count &&
+                (worker.queue.size() || !lanesEmpty() || !m_poller)) {
+                tickle();
+            }
         }
 
         // Schedule task
         // If the task is a fiber
-        if (tk.fiber && !tk.fiber->isDone()) {
-            tk.fiber->call(); // Do the task
+        if (tk.fiber) {
+            bool preempted = false;
+            if (!tk.fiber->isDone()) {
+                Worker::Bump(worker.fibers_resumed);
+                uint64_t start_us = m_stats_enabled ? NowUs() : 0;
+                beginSlice(worker);
+                tk.fiber->call(); // Do the task
+                preempted = endSlice(worker);
+                if (start_us) {
+                    worker.run_us.add(NowUs() - start_us);
+                }
+                // The fiber may have handed control on with Fiber::TransferTo,
+                // then it is parked elsewhere and the one that came back matters.
+                if (Fiber::ptr back = Fiber::TakeReturned()) {
+                    tk.fiber = std::move(back);
+                }
+            }
             --m_active_threads; // Back from the task
 
             // Reschedule if the task ready
             if (tk.fiber->getState() == Fiber::READY) {
-                schedule(std::move(tk.fiber));
+                reschedule(std::move(tk.fiber), tk.priority, tk.thread_id, preempted); // stays pinned
+            } else if (tk.fiber->isDone() && tk.fiber.use_count() == 1) {
+                recycleFiber(fiber_pool, std::move(tk.fiber)); // nobody else refers to it
             }
             tk.reset();
         } 
         // If the task is a function
         else if (tk.func) {
-            if (func_fiber) {
-                func_fiber->reset(std::move(tk.func));
-            } else {
-                func_fiber = Fiber::ptr(new Fiber(std::move(tk.func)));
-            }
+            Fiber::ptr func_fiber = obtainFiber(fiber_pool, std::move(tk.func), tk.stacksize);
+            int thread_id = tk.thread_id;
+            Priority priority = tk.priority;
             tk.reset();
+            Worker::Bump(worker.tasks_run);
+            uint64_t start_us = m_stats_enabled ? NowUs() : 0;
+            beginSlice(worker);
             func_fiber->call(); // Do the task
+            bool preempted = endSlice(worker);
+            if (start_us) {
+                worker.run_us.add(NowUs() - start_us);
+            }
+            if (Fiber::ptr back = Fiber::TakeReturned()) {
+                func_fiber = std::move(back);
+            }
             --m_active_threads; // Back from the task
 
             // Reschedule if the task is not done
             if (func_fiber->getState() == Fiber::READY) {
-                schedule(func_fiber);
-                func_fiber.reset(); // create a new fiber, don't hold to current fiber.
+                reschedule(std::move(func_fiber), priority, thread_id, preempted);
             } else if (func_fiber->isDone()) {
-                func_fiber->reset(nullptr); // the current fiber is done, we can overwrite it.
-            } else { // RUNNING(not likely, because we yield into here) OR SUSPENSE
-                func_fiber.reset(); // creata a new fiber, don't hold to current fiber.
+                recycleFiber(fiber_pool, std::move(func_fiber));
             }
-
+            // SUSPEND: whoever wakes the fiber holds it now, drop our reference.
         }
         else {
-            // Stopping and break out run.
+            // Trap into idle fiber.
+            ++m_idle_threads;
+            uint64_t idle_start_us = NowUs();
+            worker.idle_since_us.store(idle_start_us, std::memory_order_relaxed);
+            idle_fiber->call();
+            worker.idle_since_us.store(0, std::memory_order_relaxed);
+            Worker::Bump(worker.idle_us, NowUs() - idle_start_us);
+            --m_idle_threads;
+
+            // Stopping or retired, break out run.
             // The idle fiber has terminated.
             if (idle_fiber->isDone()) {
                 EVA_LOG_DEBUG(g_logger) << "idle fiber terminate";
                 break;
             }
+        }
+    }
 
-            // Trap into idle fiber.
-            ++m_idle_threads;
-            idle_fiber->call();
-            --m_idle_threads;
+    // The caller thread of use_caller goes on outside the scheduler.
+    Fiber::SetYieldRequest(nullptr);
+    t_scheduler = nullptr;
+    set_hook(false);
+}
+
+bool Scheduler::enqueue(Task* task, bool shared) {
+    if (m_stats_enabled && !task->enqueued_us) {
+        task->enqueued_us = NowUs();
+    }
+    ++m_queued;
+    ++m_scheduled_count;
+    ++m_depth[task->priority];
+    if (task->thread_id != -1) {
+        if (Worker* worker = getWorker(task->thread_id)) {
+            bool pinned = false;
+            bool was_empty = false;
+            {
+                MutexGuard<Mutex> lk(worker->pinned_mutex);
+                // unless it has just retired
+                if (worker->thread_id == task->thread_id) {
+                    worker->pinned.push_back(task);
+                    ++worker->pinned_count;
+                    pinned = true;
+                    was_empty = worker->pinned.size() == 1;
+                }
+            }
+            if (was_empty) {
+                wakeWorker(*worker); // nobody else may run it
+            }
+            if (pinned) {
+                return false;
+            }
+        }
+        // not one of ours, it waits in the inject queue
+    } else if ((task->priority == NORMAL_PRIORITY || t_own_events) && t_scheduler == this && !shared) {
+        // The tasks of the IO events of a worker's own epoll stay with it.
+        Worker& worker = *m_workers[t_worker_index];
+        if (worker.queue.push(task)) {
+            return worker.queue.size() == 1;
+        }
+        // full, spill over to the inject queue
+    }
+
+    return m_lanes[task->priority]->push(task);
+}
+
+Scheduler::Worker* Scheduler::getWorker(pid_t thread_id) {
+    // A handful of workers, cheaper than any map.
+    for (auto& worker : m_workers) {
+        if (worker->thread_id == thread_id) {
+            return worker.get();
+        }
+    }
+    return nullptr;
+}
+
+Scheduler::Task* Scheduler::dequeue(Worker& worker) {
+    if (worker.pinned_batch.empty() && worker.pinned_count) {
+        MutexGuard<Mutex> lk(worker.pinned_mutex);
+        size_t n = std::min<size_t>(worker.pinned.size(), m_batch);
+        worker.pinned_batch.insert(worker.pinned_batch.end(),
+                                   worker.pinned.begin(), worker.pinned.begin() + n);
+        worker.pinned.erase(worker.pinned.begin(), worker.pinned.begin() + n);
+        worker.pinned_count -= n;
+    }
+    if (!worker.pinned_batch.empty()) {
+        Task* task = worker.pinned_batch.front();
+        worker.pinned_batch.pop_front();
+        return task;
+    }
+
+    // Pick the lane to look at first in proportion to the weights.
+    uint32_t high = m_weights[HIGH_PRIORITY];
+    uint32_t normal = m_weights[NORMAL_PRIORITY];
+    uint32_t slot = worker.lane_tick++ % (high + normal + m_weights[BACKGROUND_PRIORITY]);
+    Priority first = slot < high ? HIGH_PRIORITY
+                   : slot < high + normal ? NORMAL_PRIORITY : BACKGROUND_PRIORITY;
+    if (Task* task = dequeueLane(worker, first)) {
+        return task;
+    }
+    for (int prio = 0; prio < PRIORITY_COUNT; ++prio) {
+        if (prio == first) {
+            continue;
+        }
+        if (Task* task = dequeueLane(worker, (Priority)prio)) {
+            return task;
+        }
+    }
+    return nullptr;
+}
+
+Scheduler::Task* Scheduler::dequeueLane(Worker& worker, Priority prio) {
+    Lane& lane = *m_lanes[prio];
+    if (prio != NORMAL_PRIORITY) {
+        return lane.pop(worker.thread_id);
+    }
+
+    // Now and then look at the inject queue first, or a worker busy with
+    // its own tasks would never pick up tasks from outside.
+    if (++worker.tick % INJECT_CHECK_INTERVAL == 0) {
+        if (Task* task = popBatch(worker, lane)) {
+            return task;
         }
     }
+    if (Task* task = worker.queue.pop()) {
+        return task;
+    }
+    if (Task* task = popBatch(worker, lane)) {
+        return task;
+    }
+
+    // Steal from the other workers, starting at a random one.
+    size_t n = m_workers.size();
+    worker.seed ^= worker.seed << 13;
+    worker.seed ^= worker.seed >> 17;
+    worker.seed ^= worker.seed << 5;
+    for (size_t i = 0; i < n; ++i) {
+        Worker& victim = *m_workers[(worker.seed + i) % n];
+        if (&victim == &worker) {
+            continue;
+        }
+        if (Task* task = worker.queue.stealFrom(victim.queue)) {
+            Worker::Bump(worker.steals);
+            return task;
+        }
+    }
+    return nullptr;
+}
+
+Scheduler::Task* Scheduler::popBatch(Worker& worker, Lane& lane) {
+    // Leave some for the other workers, and room in the run queue.
+    size_t n = std::min<size_t>(m_batch, lane.size / std::max<size_t>(m_running_threads, 1) + 1);
+    n = std::min(n, LOCAL_QUEUE_SIZE - worker.queue.size());
+    n = std::max<size_t>(n, 1);
+
+    Task* batch[MAX_DEQUEUE_BATCH];
+    n = lane.pop(worker.thread_id, batch, n);
+    if (!n) {
+        return nullptr;
+    }
+    ++m_batch_count;
+    m_batched_tasks += n;
+    // Stealable from the run queue, like the tasks the worker schedules.
+    for (size_t i = 1; i < n; ++i) {
+        if (!worker.queue.push(batch[i])) {
+            lane.push(batch[i]);
+        }
+    }
+    return batch[0];
+}
+
+void Scheduler::setDequeueBatch(size_t batch) {
+    ASSERT(batch > 0 && batch <= MAX_DEQUEUE_BATCH);
+    m_batch = batch;
+}
+
+bool Scheduler::lanesEmpty() const {
+    for (auto& lane : m_lanes) {
+        if (lane->size) {
+            return false;
+        }
+    }
+    return true;
+}
+
+Fiber::ptr Scheduler::obtainFiber(std::vector<Fiber::ptr>& pool, InlineFunction&& func,
+                                  size_t stacksize) {
+    stacksize = StackAllocator::RoundUp(stacksize ? stacksize : m_stacksize);
+    for (auto it = pool.rbegin(); it != pool.rend(); ++it) {
+        if ((*it)->getStackSize() == stacksize) {
+            Fiber::ptr fiber = std::move(*it);
+            pool.erase(std::next(it).base());
+            fiber->reset(std::move(func));
+            ++m_fiber_pool_hits;
+            return fiber;
+        }
+    }
+    ++m_fiber_pool_misses;
+    return Fiber::ptr(new Fiber(std::move(func), stacksize));
+}
+
+void Scheduler::recycleFiber(std::vector<Fiber::ptr>& pool, Fiber::ptr&& fiber) {
+    if (pool.size() >= MAX_POOLED_FIBERS || fiber->isSharedStack()) {
+        fiber.reset();
+        return;
+    }
+    fiber->reset(nullptr); // release whatever the finished task captured
+    pool.push_back(std::move(fiber));
+}
+
+void Scheduler::scheduleNext(Fiber::ptr fiber) {
+    // Only a worker of this scheduler has a slot, and a shared stack fiber
+    // has to go back to its own thread.
+    if (t_scheduler != this ||
+        (fiber->getHomeThread() && fiber->getHomeThread() != GetThreadId())) {
+        schedule(std::move(fiber));
+        return;
+    }
+
+    if (t_lifo_fiber) {
+        schedule(std::move(t_lifo_fiber));
+    }
+    t_lifo_fiber = std::move(fiber);
 }
 
 void Scheduler::tickle() {
-    if (m_idle_threads <= 0) {
+    // A worker that was woken and has not looked for work yet will pick
+    // this up as well.
+    if (m_waking) {
+        return;
+    }
+    std::atomic_thread_fence(std::memory_order_seq_cst); // pairs with sleep()
+    if (m_sleeping_count) {
+        Worker* worker = nullptr;
+        {
+            MutexGuard<Mutex> lk(m_sleep_mutex);
+            if (!m_sleeping.empty()) {
+                worker = m_sleeping.back(); // the most recently active one
+                m_sleeping.pop_back();
+                worker->sleeping = false;
+                --m_sleeping_count;
+            }
+        }
+        if (worker) {
+            notify(*worker);
+            return;
+        }
+    }
+    // Nobody sleeps, the workers are busy or one waits in epoll.
+    wakePoller();
+}
+
+void Scheduler::wakeWorker(Worker& worker) {
+    std::atomic_thread_fence(std::memory_order_seq_cst); // pairs with sleep()
+    if (m_reactor_mode == SHARED_REACTOR && m_poller == &worker) {
+        wakePoller();
+        return;
+    }
+    {
+        MutexGuard<Mutex> lk(m_sleep_mutex);
+        if (!worker.sleeping) {
+            return; // busy, it sees its pinned queue before it sleeps
+        }
+        m_sleeping.erase(std::find(m_sleeping.begin(), m_sleeping.end(), &worker));
+        worker.sleeping = false;
+        --m_sleeping_count;
+    }
+    notify(worker);
+}
+
+void Scheduler::wakeAll() {
+    for (auto& worker : m_workers) {
+        wakeWorker(*worker);
+    }
+    wakePoller();
+}
+
+void Scheduler::wakePoller() {
+    if (m_reactor_mode != SHARED_REACTOR) {
+        // The poller waits on its own epoll, like any sleeping worker.
+        Worker* poller = m_poller;
+        if (poller && !m_poller_notified.exchange(true)) {
+            wakeWorker(*poller);
+        }
         return;
     }
-    EVA_LOG_DEBUG(g_logger) << "tickle";
-    ASSERT(write(m_tickle_fds[1], "T", 1) == 1);
+    Worker* poller = m_poller;
+    if (poller && !m_poller_notified.exchange(true)) {
+        uint64_t one = 1;
+        ASSERT(write(m_tickle_fd, &one, sizeof(one)) == sizeof(one));
+        ++m_wakeup_count;
+        ++poller->tickles;
+    }
+}
+
+void Scheduler::notify(Worker& worker) {
+    if (!worker.notified.exchange(true)) {
+        ++m_waking;
+        uint64_t one = 1;
+        ASSERT(write(worker.wake_fd, &one, sizeof(one)) == sizeof(one));
+        ++m_wakeup_count;
+        ++worker.tickles;
+    }
+}
+
+bool Scheduler::hasWork(Worker& worker) {
+    if (worker.pinned_count || !lanesEmpty()) {
+        return true;
+    }
+    for (auto& w : m_workers) {
+        if (!w->queue.empty()) {
+            return true;
+        }
+    }
+    return false;
 }
 
 Scheduler* Scheduler::GetThis() {
@@ -211,13 +1392,17 @@ Fiber* Scheduler::GetMainFiber() {
 
 bool Scheduler::shouldStop() {
     MutexGuard<MutexType> lk(m_mutex);
+    if (m_force_stop) {
+        return m_stopping; // the deadline of stop() passed
+    }
     // Only to stop when stop is called and all tasks are done.
-    return !hasTimers() && m_auto_stop && m_stopping && m_tasks.empty() 
-           && m_active_threads == 0 && m_pending_count == 0;
+    return !hasTimers() && m_auto_stop && m_stopping && m_active_threads == 0
+           && m_queued == 0 && m_pending_count == 0 && m_offload_waiters == 0;
 }
 
 void Scheduler::idle() {
     EVA_LOG_DEBUG(g_logger) <<  "idle";
+    Worker& worker = *m_workers[t_worker_index];
     epoll_event *events = new epoll_event[MAX_EVENTS];
     std::shared_ptr<epoll_event> events_deleter(events, [](epoll_event *ptr) { delete[] ptr; });
 
@@ -229,8 +1414,50 @@ void Scheduler::idle() {
             break;
         }
 
+        auto idle_start = std::chrono::steady_clock::now();
         int rt = 0;
-        while (true)  {
+
+        // One idle worker at a time waits in epoll for IO events and timers,
+        // the others sleep until they are woken for a task. Before that they
+        // may poll for a while, see setIdlePolicy().
+        Worker* no_poller = nullptr;
+        if (m_reactor_mode != SHARED_REACTOR) {
+            // Every worker waits for the IO events of its own fds.
+            if (spin(worker, worker.epfd, events, rt)) {
+                t_own_events = true;
+                for (int i = 0; i < rt; ++i) {
+                    if (events[i].data.ptr) {
+                        scheduleEvent(events[i]);
+                    }
+                }
+                t_own_events = false;
+            } else {
+                react(worker, m_poller.compare_exchange_strong(no_poller, &worker), events);
+                if (!worker.thread_id) {
+                    return; // retired
+                }
+            }
+            noteIdleGap(worker, idle_start);
+            Fiber::Yield();
+            continue;
+        }
+        // Only the poller may take events from the shared epoll.
+        bool poller = m_poller.compare_exchange_strong(no_poller, &worker);
+        bool found = spin(worker, poller ? m_epfd : -1, events, rt);
+        if (!poller) {
+            if (!found) {
+                sleep(worker);
+                if (!worker.thread_id) {
+                    return; // retired
+                }
+            }
+            noteIdleGap(worker, idle_start);
+            Fiber::Yield();
+            continue;
+        }
+
+        bool may_retire = false;
+        while (!found)  {
             // EVA_LOG_DEBUG(g_logger) << "epoll_wait waiting";
 
             // calculate how long should epoll_wait block
@@ -241,10 +1468,27 @@ void Scheduler::idle() {
             if (next_time != ~0ull && next_time < EPOLL_WAIT_TIMEOUT_MS) {
                 timeout = next_time;
             }
+            // An elastic worker gives up polling when nothing comes.
+            may_retire = worker.elastic && m_retire_idle_ms < (uint64_t)timeout;
+            if (may_retire) {
+                timeout = m_retire_idle_ms;
+            }
+
+            // A task queued or a stop() before we became the poller did
+            // not wake us.
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (hasWork(worker) || shouldStop()) {
+                timeout = 0;
+                may_retire = false;
+            }
 
             // Block util events appear
             // It may wake up from tickle and other registered IO events
             rt = epoll_wait(m_epfd, events, MAX_EVENTS, (int)timeout);
+            if (rt > 0) {
+                Worker::Bump(worker.epoll_wakeups);
+            }
+            found = true;
             if (rt < 0 && errno == EINTR) {
                 // 0: timeout with no events, may be a timer has expired
                 // -1: error
@@ -255,20 +1499,28 @@ void Scheduler::idle() {
             }
         }
 
+        // Hand the poller role back before scheduling, another idle worker
+        // can take it over meanwhile.
+        m_poller_notified = false;
+        m_poller = nullptr;
+
         // schedule expired timers
         getExpiredFuncs(expired_funcs);
         if (!expired_funcs.empty()) {
-            schedule(expired_funcs.begin(), expired_funcs.end());
+            schedule(expired_funcs.begin(), expired_funcs.end(), HIGH_PRIORITY);
             expired_funcs.clear();
+        } else if (rt == 0 && may_retire && retire(worker, false)) {
+            tickle(); // a sleeping worker takes over polling
+            return;
         }
 
         // schedule other events
         for (int i = 0; i < rt; ++i) {
             epoll_event event = events[i];
-            // clear out the tickle fds
-            if (event.data.fd == m_tickle_fds[0]) {
-                char dummy[256];
-                while(read(m_tickle_fds[0], dummy, sizeof(dummy)) > 0);
+            // clear out the tickle fd
+            if (!event.data.ptr) {
+                uint64_t dummy;
+                while (read(m_tickle_fd, &dummy, sizeof(dummy)) > 0);
                 continue;
             }
 
@@ -276,12 +1528,195 @@ void Scheduler::idle() {
             scheduleEvent(event);
 
         }
+        noteIdleGap(worker, idle_start);
         Fiber::Yield();
     }
+
+    // Let the sleeping workers see it, too.
+    wakeAll();
+}
+
+bool Scheduler::spin(Worker& worker, int epfd, epoll_event* events, int& rt) {
+    uint64_t spin_us = m_spin_us;
+    uint64_t yield_us = m_yield_us;
+    if (m_adaptive_spin) {
+        spin_us = std::min(spin_us, worker.spin_budget_us);
+    }
+    if (!spin_us && !yield_us) {
+        return false;
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    auto spin_end = now + std::chrono::microseconds(spin_us);
+    auto end = spin_end + std::chrono::microseconds(yield_us);
+    std::vector<std::function<void()>> expired_funcs;
+    while (true) {
+        if (hasWork(worker)) {
+            break;
+        }
+        if (epfd >= 0 && (rt = epoll_wait(epfd, events, MAX_EVENTS, 0)) > 0) {
+            Worker::Bump(worker.epoll_wakeups);
+            break;
+        }
+        rt = 0;
+        if (getNextTimeMs() == 0) {
+            getExpiredFuncs(expired_funcs);
+            if (!expired_funcs.empty()) {
+                schedule(expired_funcs.begin(), expired_funcs.end(), HIGH_PRIORITY);
+                break;
+            }
+        }
+
+        now = std::chrono::steady_clock::now();
+        if (now >= end) {
+            ++m_spin_misses;
+            return false;
+        }
+        if (now >= spin_end) {
+            sched_yield();
+        }
+    }
+    ++m_spin_hits;
+    return true;
+}
+
+void Scheduler::noteIdleGap(Worker& worker, std::chrono::steady_clock::time_point idle_start) {
+    if (!m_adaptive_spin) {
+        return;
+    }
+    uint64_t gap_us = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - idle_start).count();
+    worker.gap_us = (worker.gap_us * 7 + gap_us) / 8;
+    // Spinning only pays off when work tends to show up within the budget.
+    worker.spin_budget_us = worker.gap_us * 2 <= m_spin_us ? worker.gap_us * 2 : 0;
+}
+
+void Scheduler::sleep(Worker& worker) {
+    {
+        MutexGuard<Mutex> lk(m_sleep_mutex);
+        m_sleeping.push_back(&worker);
+        worker.sleeping = true;
+        ++m_sleeping_count;
+    }
+
+    // A task queued before we were on m_sleeping did not wake us, neither
+    // does anything when the poller has gone.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (hasWork(worker) || !m_poller || shouldStop()) {
+        MutexGuard<Mutex> lk(m_sleep_mutex);
+        if (worker.sleeping) {
+            m_sleeping.erase(std::find(m_sleeping.begin(), m_sleeping.end(), &worker));
+            worker.sleeping = false;
+            --m_sleeping_count;
+            return;
+        }
+        // someone took us off already, its wake-up is on the way
+    }
+
+    // An elastic worker that is not needed for a while retires.
+    if (worker.elastic) {
+        pollfd pfd = { worker.wake_fd, POLLIN, 0 };
+        int rt = 0;
+        while ((rt = poll(&pfd, 1, (int)m_retire_idle_ms)) < 0 && errno == EINTR);
+        if (rt == 0 && retire(worker, true)) {
+            return;
+        }
+    }
+
+    uint64_t dummy;
+    while (read(worker.wake_fd, &dummy, sizeof(dummy)) < 0 && errno == EINTR);
+    worker.notified = false;
+    --m_waking;
+}
+
+void Scheduler::react(Worker& worker, bool poller, epoll_event* events) {
+    {
+        MutexGuard<Mutex> lk(m_sleep_mutex);
+        m_sleeping.push_back(&worker);
+        worker.sleeping = true;
+        ++m_sleeping_count;
+    }
+
+    uint64_t timeout = EPOLL_WAIT_TIMEOUT_MS;
+    if (poller) {
+        auto next_time = getNextTimeMs();
+        if (next_time != ~0ull && next_time < EPOLL_WAIT_TIMEOUT_MS) {
+            timeout = next_time;
+        }
+    }
+    // Then an elastic worker retires, see sleep().
+    bool may_retire = worker.elastic && m_retire_idle_ms < timeout;
+    if (may_retire) {
+        timeout = m_retire_idle_ms;
+    }
+
+    // As in sleep(), plus a poller that missed a change of the timers.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (hasWork(worker) || shouldStop() || (poller ? (bool)m_poller_notified : !m_poller)) {
+        timeout = 0;
+        may_retire = false;
+    }
+
+    int rt = epoll_wait(worker.epfd, events, MAX_EVENTS, (int)timeout);
+    if (rt > 0) {
+        Worker::Bump(worker.epoll_wakeups);
+    }
+    if (rt == 0 && may_retire && retire(worker, true)) {
+        if (poller) {
+            m_poller_notified = false;
+            m_poller = nullptr;
+            tickle(); // a sleeping worker takes over polling
+        }
+        return;
+    }
+    bool woken = false;
+    t_own_events = true;
+    for (int i = 0; i < rt; ++i) {
+        if (!events[i].data.ptr) {
+            woken = true;
+            continue;
+        }
+        scheduleEvent(events[i]);
+    }
+    t_own_events = false;
+
+    if (!woken) {
+        MutexGuard<Mutex> lk(m_sleep_mutex);
+        if (worker.sleeping) {
+            m_sleeping.erase(std::find(m_sleeping.begin(), m_sleeping.end(), &worker));
+            worker.sleeping = false;
+            --m_sleeping_count;
+        } else {
+            woken = true; // taken off, its wake-up is about to be written
+        }
+    }
+    if (woken) {
+        uint64_t dummy;
+        while (read(worker.wake_fd, &dummy, sizeof(dummy)) < 0 && errno == EINTR);
+        worker.notified = false;
+        --m_waking;
+    }
+
+    if (poller) {
+        m_poller_notified = false;
+        m_poller = nullptr;
+
+        std::vector<std::function<void()>> expired_funcs;
+        getExpiredFuncs(expired_funcs);
+        if (!expired_funcs.empty()) {
+            schedule(expired_funcs.begin(), expired_funcs.end(), HIGH_PRIORITY);
+        }
+    }
 }
 
 void Scheduler::onFirstTimerChanged() {
-    tickle();
+    // The poller has to compute a new timeout. Without one, a sleeping
+    // worker takes its place.
+    if (m_poller) {
+        wakePoller();
+    } else {
+        tickle();
+    }
 }
 
 }
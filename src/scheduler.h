@@ -1,26 +1,81 @@
 #pragma once
 
 #include "fiber.h"
+#include "future.h"
+#include "histogram.h"
+#include "inline_function.h"
 #include "noncopyable.h"
+#include "offload_pool.h"
 #include "thread.h"
 #include "mutex.h"
 #include "macro.h"
 #include "timer.h"
 #include <vector>
-#include <list>
 #include <functional>
 #include <atomic>
+#include <chrono>
+#include <memory>
+#include <stdexcept>
 #include <sys/epoll.h>
 
 namespace eva01 {
 
+// What Scheduler::async() fails with when the task is not admitted, see
+// Scheduler::setQueueCapacity().
+class TaskRejected : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
 class Scheduler : public TimerManager {
 
 public:
     using ptr = std::shared_ptr<Scheduler>;
     using MutexType = Mutex;
 
-    Scheduler(int threads = 1, const std::string& name = "main");
+    // Where the workers wait for IO events, see IOManager.
+    enum ReactorMode {
+        SHARED_REACTOR = 0,  // one epoll for all workers
+        ROUND_ROBIN_REACTOR, // an epoll per worker, fds spread round-robin
+        CALLER_REACTOR,      // an epoll per worker, an fd goes to the worker adding it
+    };
+
+    // Lanes of queued tasks, see setPriorityWeight().
+    enum Priority {
+        HIGH_PRIORITY = 0,   // IO events and timers
+        NORMAL_PRIORITY,
+        BACKGROUND_PRIORITY,
+        PRIORITY_COUNT
+    };
+
+    // What schedule() does with a function task when the queues are full.
+    enum QueuePolicy {
+        BLOCK_WHEN_FULL = 0, // park the producer until a worker takes a task
+        REJECT_WHEN_FULL,    // refuse the new task
+        DROP_OLDEST,         // drop the oldest one waiting in a lane
+    };
+
+    // What stop() with a deadline does with the pending timers.
+    enum TimerPolicy {
+        WAIT_TIMERS = 0, // run them as they expire, up to the deadline
+        CANCEL_TIMERS,   // drop them
+        FIRE_TIMERS,     // run each once right away
+    };
+
+    // What stop() with a deadline got done. Offloaded jobs are not covered,
+    // stop() waits for those running or queued whatever the deadline.
+    struct StopReport {
+        bool drained = true;       // all work was done before the deadline
+        uint64_t elapsed_ms = 0;
+        size_t timers = 0;         // cancelled or fired at once, see TimerPolicy
+        size_t dropped_tasks = 0;  // queued at the deadline or woken by offloaded jobs, never run
+        size_t dropped_timers = 0; // still pending at the deadline
+    };
+
+    // With use_caller the constructing thread is one of the `threads` workers:
+    // it runs tasks from stop() until all work is done, or from runInCaller().
+    // start() and stop() have to be called from that thread then.
+    Scheduler(int threads = 1, const std::string& name = "main", bool use_caller = false);
     virtual ~Scheduler();
 
 public:
@@ -29,53 +84,390 @@ public:
 
     const std::string& getName() const { return m_name; }
     void start();
+    // Wait for all queued work and stop the workers. From inside the loop of
+    // runInCaller() it only asks it to stop.
     void stop();
+    // Stop within deadline_ms: refuse new function tasks of normal and
+    // background priority, deal with the timers as policy says and wake all
+    // workers. What is not done by the deadline is dropped: the queued tasks
+    // (their Futures fail with broken_promise), the timers, and running
+    // tasks are asked to yield at their next Fiber::MaybeYield() and go no
+    // further. A task that blocks and never yields still holds up the
+    // return, and so do the jobs in the offload pool: offloaded calls are
+    // not bounded by the deadline. Not from a worker or from inside
+    // runInCaller().
+    StopReport stop(uint64_t deadline_ms, TimerPolicy timers = CANCEL_TIMERS);
+    // use_caller only: run the loop on the calling thread, after start(),
+    // until stop() is called and all work is done.
+    void runInCaller();
+    bool isUseCaller() const { return m_use_caller; }
+
+    // Thread ids of the running workers, valid after start().
+    std::vector<pid_t> getThreadIds() const;
+
+    // Let the pool grow from `threads` up to max_threads, one worker at a
+    // time, while the estimated wait of the queued tasks stays above
+    // latency_ms, e.g. because tasks block in calls that are not hooked.
+    // Workers that slept for idle_ms retire, down to min_threads. Only
+    // before start(), min_threads <= threads <= max_threads. The first
+    // min_threads workers and the caller never retire: only they take fds
+    // in the sharded reactor modes, and only they should get pinned tasks.
+    // Neither does a worker with a suspended shared stack fiber bound to it.
+    void setElasticPool(size_t min_threads, size_t max_threads,
+                        uint64_t latency_ms = 10, uint64_t idle_ms = 1000);
+    size_t getMinThreads() const { return m_min_threads; }
+    size_t getMaxThreads() const { return m_max_threads; }
+    // Workers with a thread right now.
+    size_t getThreadCount() const { return m_running_threads; }
+    // Workers added and retired so far, and the last estimate of the wait.
+    uint64_t getGrowCount() const { return m_grow_count; }
+    uint64_t getRetireCount() const { return m_retire_count; }
+    uint64_t getQueueLatencyMs() const { return m_queue_latency_ms; }
+
+    // Pin worker i to the CPUs cpu_sets[i % cpu_sets.size()], only before
+    // start(). A core worker allocates its queues on its own thread, so they
+    // end up on its NUMA node; elastic workers get theirs from start() on the
+    // calling thread. The placement is logged at start().
+    void setCpuAffinity(std::vector<std::vector<int>> cpu_sets);
+    const std::vector<std::vector<int>>& getCpuAffinity() const { return m_cpu_sets; }
+
+    // Only before start().
+    ReactorMode getReactorMode() const { return m_reactor_mode; }
+    void setReactorMode(ReactorMode mode);
+
+    // Stack size of the fibers created for function tasks scheduled without one.
+    size_t getStackSize() const { return m_stacksize; }
+    void setStackSize(size_t stacksize) { m_stacksize = stacksize; }
 
+    // Function tasks that found a terminated fiber to reuse, or had to create one.
+    uint64_t getFiberPoolHits() const { return m_fiber_pool_hits; }
+    uint64_t getFiberPoolMisses() const { return m_fiber_pool_misses; }
+
+    // An idle worker keeps polling its queues, epoll and timers for spin_us
+    // and then for yield_us more with sched_yield() in between, before it
+    // blocks. With adaptive, the spin time follows the recent idle times
+    // of the worker, up to spin_us, and drops to 0 while they are longer.
+    // All 0 by default, a worker blocks at once.
+    void setIdlePolicy(uint64_t spin_us, uint64_t yield_us = 0, bool adaptive = false);
+    uint64_t getSpinTime() const { return m_spin_us; }
+    uint64_t getYieldTime() const { return m_yield_us; }
+    bool isAdaptiveSpin() const { return m_adaptive_spin; }
+    // Idle periods that ended while polling, without blocking, and those
+    // that polled in vain and blocked after all.
+    uint64_t getSpinHits() const { return m_spin_hits; }
+    uint64_t getSpinMisses() const { return m_spin_misses; }
+
+    // Workers pick the lane they look at first in proportion to the
+    // weights, then fall back to the others in order of priority. So high
+    // priority tasks mostly go first, and background tasks still get their
+    // share while the other lanes are busy. Defaults are 8, 4 and 1.
+    void setPriorityWeight(Priority prio, uint32_t weight);
+    uint32_t getPriorityWeight(Priority prio) const { return m_weights[prio]; }
+    // Tasks of prio queued and not taken yet.
+    size_t getQueueDepth(Priority prio) const { return m_depth[prio]; }
+
+    // Tasks a worker takes from the inject queue, or from its pinned queue,
+    // under one lock, at most 128. It takes fewer when
+    // there are not enough for the other workers to get as many. The extra
+    // tasks go to its run queue, where idle workers can steal them. 16 by
+    // default.
+    void setDequeueBatch(size_t batch);
+    size_t getDequeueBatch() const { return m_batch; }
+    // Batches taken from the inject queue, and the tasks in them.
+    uint64_t getBatchCount() const { return m_batch_count; }
+    uint64_t getBatchedTasks() const { return m_batched_tasks; }
+
+    // Tasks queued so far and eventfd writes it took to wake workers for them.
+    uint64_t getScheduledCount() const { return m_scheduled_count; }
+    uint64_t getWakeupCount() const { return m_wakeup_count; }
+
+    // Counters of one worker slot since start(), see getStats().
+    struct WorkerStats {
+        pid_t thread_id = 0;        // 0 while the slot has no thread
+        uint64_t tasks_run = 0;     // function tasks started
+        uint64_t fibers_resumed = 0;
+        uint64_t steals = 0;        // successful steals from other workers
+        uint64_t tickles = 0;       // wake-ups written for this worker
+        uint64_t epoll_wakeups = 0; // epoll_wait() calls that returned events
+        uint64_t idle_us = 0;
+    };
+
+    struct Stats {
+        std::vector<WorkerStats> workers;
+        size_t queue_depth[PRIORITY_COUNT] = {};
+        uint64_t scheduled = 0;
+        uint64_t wakeups = 0;
+        // Only while stats are enabled: microseconds from queueing a task to
+        // running it, and of a task running until it switches out.
+        Histogram wait_us;
+        Histogram run_us;
+    };
+
+    // The counters are kept by each worker for itself and always on. The
+    // histograms read the clock around every task, so they are off by
+    // default.
+    void setStatsEnabled(bool enabled) { m_stats_enabled = enabled; }
+    bool isStatsEnabled() const { return m_stats_enabled; }
+    // A snapshot while the scheduler runs, empty workers before start().
+    // The counters are read one by one and may be a few tasks apart.
+    Stats getStats();
+
+    // Let at most capacity function tasks of normal and background priority
+    // wait in the queues; policy says what happens to more. Fibers that are
+    // woken or yield, IO events, timers and high priority tasks are work
+    // already taken on and always get in. DROP_OLDEST drops from the
+    // background lane first and only from the shared lanes, not from the
+    // run queues of the workers; the Future of a dropped async() task fails
+    // with broken_promise. Only before start(), 0 (the default) is unbounded.
+    void setQueueCapacity(size_t capacity, QueuePolicy policy = BLOCK_WHEN_FULL);
+    size_t getQueueCapacity() const { return m_capacity; }
+    QueuePolicy getQueuePolicy() const { return m_queue_policy; }
+
+    // Shed load like CoDel: once the tasks taken by the workers have waited
+    // longer than target_ms for a whole interval_ms, the scheduler is
+    // overloaded and refuses new function tasks as above, until one waited
+    // less again or the queues ran empty. Only before start(), 0 (the
+    // default) turns it off.
+    void setSojournTarget(uint64_t target_ms, uint64_t interval_ms = 100);
+    uint64_t getSojournTarget() const { return m_sojourn_target_us / 1000; }
+    // For accept loops and the like, to turn new work away early.
+    bool isOverloaded();
+
+    // Tasks refused because the queues were full, dropped for newer ones,
+    // producers that had to wait for room, and tasks refused while overloaded.
+    uint64_t getRejectedCount() const { return m_rejected_count; }
+    uint64_t getDroppedCount() const { return m_dropped_count; }
+    uint64_t getBlockedCount() const { return m_blocked_count; }
+    uint64_t getShedCount() const { return m_shed_count; }
+
+    // stacksize only applies to functions, 0 means the scheduler default.
+    // A function may be move-only; small ones are stored in the task itself.
+    // false if the task was not admitted, see setQueueCapacity().
+    //
+    // A task for a specific thread (thr, see getThreadIds()) goes to the
+    // pinned queue of that worker. Otherwise from a worker of this scheduler
+    // the task goes to the run queue of that worker, where idle workers may
+    // steal it, and from other threads to the shared inject queue.
     template <typename FiberOrFunc>
-    void schedule(FiberOrFunc f, int thr = -1) {
-        MutexGuard<MutexType> lk(m_mutex);
-        bool need_tickle = m_tasks.empty();
-        m_tasks.emplace_back(std::move(f), thr);
-        if (need_tickle) {
+    bool schedule(FiberOrFunc f, int thr = -1, size_t stacksize = 0) {
+        return schedule(std::move(f), NORMAL_PRIORITY, thr, stacksize);
+    }
+
+    // As above, in the lane of prio. Only normal priority tasks go to the
+    // run queue of a worker, the other lanes are shared by all workers. The
+    // exception are IO events in the sharded reactor modes, which go to the
+    // run queue of the worker whose epoll reported them.
+    template <typename FiberOrFunc>
+    bool schedule(FiberOrFunc f, Priority prio, int thr = -1, size_t stacksize = 0) {
+        Task* task = new Task(std::move(f), thr, stacksize, prio);
+        if (!admit(task)) {
+            delete task;
+            return false;
+        }
+        if (enqueue(task)) {
             tickle();
         }
+        return true;
+    }
+
+    // false if any of them was not admitted.
+    template <typename Iterator>
+    bool schedule(Iterator a, Iterator b, int thr = -1, size_t stacksize = 0) {
+        return schedule(a, b, NORMAL_PRIORITY, thr, stacksize);
     }
 
     template <typename Iterator>
-    void schedule(Iterator a, Iterator b, int thr = -1) {
-        MutexGuard<MutexType> lk(m_mutex);
-        bool need_tickle = m_tasks.empty();
+    bool schedule(Iterator a, Iterator b, Priority prio, int thr = -1, size_t stacksize = 0) {
+        bool need_tickle = false;
+        bool all = true;
         for (auto it = a; it != b; ++it) {
-            m_tasks.emplace_back(std::move(*it), thr);
+            Task* task = new Task(std::move(*it), thr, stacksize, prio);
+            if (!admit(task)) {
+                delete task;
+                all = false;
+                continue;
+            }
+            need_tickle = enqueue(task) || need_tickle;
         }
         if (need_tickle) {
             tickle();
         }
+        return all;
+    }
+
+    // Run func as a task and return a Future of its result. An exception
+    // thrown by func is rethrown by Future::get(), a task that was not
+    // admitted fails with TaskRejected.
+    template <typename Func>
+    auto async(Func func, int thr = -1, size_t stacksize = 0) -> Future<decltype(func())> {
+        Promise<decltype(func())> promise;
+        auto future = promise.getFuture();
+        if (!schedule([promise, func = std::move(func)]() mutable {
+                FulfillPromise(promise, func);
+            }, thr, stacksize)) {
+            promise.setException(std::make_exception_ptr(
+                TaskRejected("scheduler " + m_name + " rejected the task")));
+        }
+        return future;
+    }
+
+    // Run func on the offload pool and park the calling fiber until it is
+    // done, for work the hooks cannot make asynchronous: regular files,
+    // getaddrinfo(), fsync(), blocking libraries. The fiber goes on on this
+    // scheduler. Rethrows what func throws. stop() waits for offloaded calls.
+    template <typename Func>
+    auto offload(Func func) -> decltype(func()) {
+        Promise<decltype(func())> promise;
+        Future<decltype(func())> future = promise.getFuture();
+        // Counted for as long as the job lives: it has woken the fiber by
+        // the time it goes, and goes if submit() throws.
+        auto waiter = std::make_shared<OffloadWaiter>(m_offload_waiters);
+        getOffloadPool()->submit([promise, func = std::move(func), waiter = std::move(waiter)]() mutable {
+            FulfillPromise(promise, func);
+        });
+        future.wait();
+        return future.get();
     }
 
+    // A task that runs for slice_ms without switching out is asked to yield
+    // at its next Fiber::MaybeYield(); it then goes to the back of the queue
+    // so the other tasks of its thread, IO events included, get their turn.
+    // A loop that hogs a worker should call it now and then. Checked by a
+    // monitor thread every slice_ms / 2. Only before start(), 0 (the
+    // default) turns it off.
+    void setTimeSlice(uint64_t slice_ms);
+    uint64_t getTimeSlice() const { return m_time_slice_ms; }
+    // Yields asked for, and the ones that happened.
+    uint64_t getPreemptRequests() const { return m_preempt_requests; }
+    uint64_t getPreemptCount() const { return m_preempt_count; }
+
+    // Threads and queue capacity of the offload pool, only before it is
+    // first used. The pool is created on demand and goes away with stop().
+    void setOffloadPool(size_t threads, size_t capacity = 1024);
+    OffloadPool::ptr getOffloadPool();
+
+    // Run fiber on the calling worker thread right after the current task
+    // switches out, ahead of the queue. A fiber already waiting in that slot
+    // goes to the queue. From other threads this is schedule().
+    void scheduleNext(Fiber::ptr fiber);
+
 protected:
 
     void onFirstTimerChanged() override;
     virtual bool scheduleEvent(epoll_event& event) { return true; };
+    // The epoll a newly watched fd is registered with, see ReactorMode, -1
+    // once stopped.
+    int pickEpoll();
 
 private:
-    void run();
+    struct Task;
+    struct Worker;
+    struct Lane;
+
+    // One fiber waiting in offload(), see shouldStop().
+    struct OffloadWaiter {
+        explicit OffloadWaiter(std::atomic<size_t>& count)
+            : count(count) {
+            ++count;
+        }
+        ~OffloadWaiter() { --count; }
+
+        std::atomic<size_t>& count;
+    };
+
+    void threadMain(size_t index);
+    // Thread of a worker added by grow(), in the slot of a retired one.
+    void growMain(size_t index);
+    void logPlacement(Worker& worker, size_t index);
+    // Whether the worker at index may retire, see setElasticPool().
+    bool isElastic(size_t index) const;
+    // Estimate the queue latency now and then and grow the pool, and look
+    // for tasks that run past their time slice.
+    void monitor();
+    void checkTimeSlices();
+    void beginSlice(Worker& worker);
+    // true if the task was preempted.
+    bool endSlice(Worker& worker);
+    // Queue a fiber that yielded, a preempted one behind the tasks that
+    // wait in its lane rather than in the run queue of this worker.
+    void reschedule(Fiber::ptr&& fiber, Priority prio, int thread_id, bool preempted);
+    void grow();
+    // Take a worker that slept, or polled, for the idle timeout out of the
+    // pool, false if it was woken meanwhile or the pool is at its minimum.
+    bool retire(Worker& worker, bool sleeping);
+    void run(size_t index);
+    // Tell the workers to finish the work and stop, the start of stop().
+    void beginStop();
+    // The deadline of stop() passed: stop the workers after their current
+    // task and let the rest go.
+    void forceStop();
+    // Join the spawned threads and clear the workers, the rest of stop().
+    // The number of queued tasks it dropped.
+    size_t join();
+    Worker* createWorker(size_t index);
+    // Queue task, true if idle threads should be woken for it. A shared
+    // task skips the run queue of the worker and goes to its lane.
+    bool enqueue(Task* task, bool shared = false);
+    // Whether task may be queued, see setQueueCapacity(). Parks the caller
+    // for room with BLOCK_WHEN_FULL.
+    bool admit(Task* task);
+    // Room for one more task in full queues as the policy says, false if
+    // there is none.
+    bool makeRoom();
+    // A task that was admitted left the queues after waiting since enqueued_us.
+    void release(Task& task);
+    Worker* getWorker(pid_t thread_id);
+    // Next task for worker, nullptr if there is none anywhere.
+    Task* dequeue(Worker& worker);
+    Task* dequeueLane(Worker& worker, Priority prio);
+    // One task of lane to run, the rest of a batch to the run queue.
+    Task* popBatch(Worker& worker, Lane& lane);
+    bool lanesEmpty() const;
+    // Wake one sleeping worker, or else the one waiting in epoll.
     void tickle();
+    // Wake worker wherever it waits, for a task only it may run.
+    void wakeWorker(Worker& worker);
+    void wakeAll();
+    void wakePoller();
+    void notify(Worker& worker);
+    bool hasWork(Worker& worker);
     void idle();
+    void sleep(Worker& worker);
+    // Poll for work and the events of epfd (-1 for none) as the idle policy
+    // says, true if something showed up. rt is the number of events.
+    bool spin(Worker& worker, int epfd, epoll_event* events, int& rt);
+    void noteIdleGap(Worker& worker, std::chrono::steady_clock::time_point idle_start);
+    // Wait on the epoll of worker, for its fds and a wake-up, and for the
+    // timers if it is the poller.
+    void react(Worker& worker, bool poller, epoll_event* events);
     bool shouldStop();
+    Fiber::ptr obtainFiber(std::vector<Fiber::ptr>& pool, InlineFunction&& func,
+                           size_t stacksize);
+    void recycleFiber(std::vector<Fiber::ptr>& pool, Fiber::ptr&& fiber);
 
 private:
+// Allocated from a per-thread cache of nodes, see scheduler.cpp, and linked
+// into the inject queue through next.
 struct Task {
     Fiber::ptr fiber;
-    std::function<void()> func;
+    InlineFunction func;
     int thread_id;
+    size_t stacksize = 0;
+    Priority priority = NORMAL_PRIORITY;
+    bool bounded = false;      // holds a place in the queues, see admit()
+    uint64_t enqueued_us = 0;  // for the sojourn time, see setSojournTarget()
+    Task* next = nullptr;
 
-    Task(Fiber::ptr fb, int thr_id)
-        :fiber(std::move(fb)), thread_id(thr_id) {
+    Task(Fiber::ptr fb, int thr_id, size_t = 0, Priority prio = NORMAL_PRIORITY)
+        :fiber(std::move(fb)), thread_id(thr_id), priority(prio) {
+        // A shared stack fiber can only resume on the thread it started on.
+        if (fiber && fiber->getHomeThread()) {
+            thread_id = fiber->getHomeThread();
+        }
     }
 
-    Task(std::function<void()> fc, int thr_id)
-        :func(std::move(fc)), thread_id(thr_id) {
+    Task(InlineFunction fc, int thr_id, size_t stack_size = 0, Priority prio = NORMAL_PRIORITY)
+        :func(std::move(fc)), thread_id(thr_id), stacksize(stack_size), priority(prio) {
     } 
 
     Task() 
@@ -86,7 +478,15 @@ struct Task {
         fiber = nullptr;
         func = nullptr;
         thread_id = -1;
+        stacksize = 0;
+        priority = NORMAL_PRIORITY;
+        bounded = false;
+        enqueued_us = 0;
+        next = nullptr;
     }
+
+    static void* operator new(size_t size);
+    static void operator delete(void* ptr);
 };
 
 private:
@@ -94,17 +494,85 @@ private:
     Fiber::ptr m_main_fiber;
     std::string m_name;
     std::vector<Thread::ptr> m_threads;
-    std::list<Task> m_tasks;
+    std::vector<std::unique_ptr<Worker>> m_workers;
+    // Shared queues by priority, the normal one is the inject queue.
+    std::unique_ptr<Lane> m_lanes[PRIORITY_COUNT];
+    std::atomic<uint32_t> m_weights[PRIORITY_COUNT];
+    std::atomic<size_t> m_depth[PRIORITY_COUNT];
+    std::atomic<size_t> m_queued { 0 }; // tasks in all queues
 
     size_t m_thread_count = 0;
+    size_t m_min_threads = 0;
+    size_t m_max_threads = 0;
+    uint64_t m_grow_latency_ms = 0;
+    uint64_t m_retire_idle_ms = 0;
+    uint64_t m_time_slice_ms = 0;
+    Thread::ptr m_monitor; // only for an elastic pool
+    Semaphore m_monitor_stop;
+    Thread::ptr m_stop_watchdog; // see stop(deadline_ms)
+    Semaphore m_stop_done;
+    std::atomic<bool> m_closed { false };     // refuses new tasks, see admit()
+    std::atomic<bool> m_force_stop { false }; // the deadline of stop() passed
+    OffloadPool::ptr m_offload;
+    std::atomic<size_t> m_offload_waiters { 0 }; // see offload()
+    size_t m_offload_threads;
+    size_t m_offload_capacity = 1024;
+    size_t m_stacksize = DEFAULT_STACK_SIZE;
+    size_t m_capacity = 0;
+    QueuePolicy m_queue_policy = BLOCK_WHEN_FULL;
+    std::unique_ptr<FiberSemaphore> m_room; // free places, with a capacity
+    uint64_t m_sojourn_target_us = 0;
+    uint64_t m_sojourn_interval_us = 0;
+    std::atomic<uint64_t> m_above_target_since { 0 };
+    std::atomic<bool> m_overloaded { false };
     bool m_stopped = true;
     bool m_stopping = false;
     bool m_auto_stop = false;
+    bool m_use_caller = false;
+    std::atomic<bool> m_caller_running { false };
 
     std::atomic<size_t> m_active_threads{ 0 };
     std::atomic<size_t> m_idle_threads{ 0 };
+    std::atomic<uint64_t> m_fiber_pool_hits{ 0 };
+    std::atomic<uint64_t> m_fiber_pool_misses{ 0 };
+    std::atomic<uint64_t> m_scheduled_count { 0 };
+    std::atomic<uint64_t> m_wakeup_count { 0 };
+    std::atomic<uint64_t> m_spin_us { 0 };
+    std::atomic<uint64_t> m_yield_us { 0 };
+    std::atomic<bool> m_adaptive_spin { false };
+    std::atomic<uint64_t> m_spin_hits { 0 };
+    std::atomic<uint64_t> m_spin_misses { 0 };
+    std::atomic<size_t> m_running_threads { 0 };
+    std::atomic<uint64_t> m_grow_count { 0 };
+    std::atomic<uint64_t> m_retire_count { 0 };
+    std::atomic<uint64_t> m_queue_latency_ms { 0 };
+    std::atomic<size_t> m_batch { 16 };
+    std::atomic<uint64_t> m_batch_count { 0 };
+    std::atomic<uint64_t> m_batched_tasks { 0 };
+    std::atomic<uint64_t> m_preempt_requests { 0 };
+    std::atomic<uint64_t> m_preempt_count { 0 };
+    std::atomic<uint64_t> m_rejected_count { 0 };
+    std::atomic<uint64_t> m_dropped_count { 0 };
+    std::atomic<uint64_t> m_blocked_count { 0 };
+    std::atomic<uint64_t> m_shed_count { 0 };
+    std::atomic<bool> m_stats_enabled { false };
+
+    // Idle workers: one polls m_epfd, the others sleep on their eventfd.
+    std::atomic<Worker*> m_poller { nullptr };
+    std::atomic<bool> m_poller_notified { false };
+    Mutex m_sleep_mutex;
+    std::vector<Worker*> m_sleeping; // a stack, guarded by m_sleep_mutex
+    std::atomic<size_t> m_sleeping_count { 0 };
+    std::atomic<size_t> m_waking { 0 }; // woken, not back from the read yet
+
+    ReactorMode m_reactor_mode = SHARED_REACTOR;
+    std::vector<std::vector<int>> m_cpu_sets;
+    Semaphore m_workers_ready; // see start()
+    Semaphore m_workers_go;
+    std::atomic<size_t> m_next_reactor { 0 };
+
     int m_root_thread = 0;
-    int m_tickle_fds[2];
+    int m_tickle_fd = -1;
 
 protected:
     int m_epfd = 0;
@@ -13,6 +13,8 @@ public:
     ~Semaphore();
 
     void wait();
+    // false if the count is still 0 after timeout_ms
+    bool waitFor(uint64_t timeout_ms);
     void notify();
 
 private:
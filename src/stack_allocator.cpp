@@ -0,0 +1,141 @@
+#include "stack_allocator.h"
+#include "log.h"
+#include "macro.h"
+
+#include <sys/mman.h>
+#include <unistd.h>
+#include <atomic>
+#include <iterator>
+#include <new>
+#include <string.h>
+#include <vector>
+
+namespace eva01 {
+
+static Logger::ptr g_logger = EVA_LOGGER("system");
+
+constexpr const size_t MAX_POOLED_STACKS = 64;
+
+static std::atomic<uint64_t> s_mapped_count { 0 };
+
+namespace {
+
+struct StackPool {
+    struct Entry {
+        void* sp;
+        size_t size;
+    };
+
+    ~StackPool();
+
+    std::vector<Entry> stacks;
+};
+
+}
+
+// The pool is reached through a trivially destructible pointer, so fibers
+// released while the thread is tearing down its thread_locals still find out
+// that the pool is gone and unmap their stacks directly.
+static thread_local StackPool* t_pool = nullptr;
+static thread_local bool t_pool_destroyed = false;
+
+static void UnmapStack(void* sp, size_t size) {
+    size_t page = StackAllocator::GetPageSize();
+    if (munmap((char*)sp - page, size + page)) {
+        EVA_LOG_ERROR(g_logger) << "munmap stack error: " << strerror(errno);
+    }
+    --s_mapped_count;
+}
+
+StackPool::~StackPool() {
+    for (auto& e : stacks) {
+        UnmapStack(e.sp, e.size);
+    }
+    stacks.clear();
+}
+
+static StackPool* GetPool() {
+    if (t_pool || t_pool_destroyed) {
+        return t_pool;
+    }
+
+    static thread_local struct PoolHolder {
+        StackPool pool;
+        ~PoolHolder() {
+            t_pool = nullptr;
+            t_pool_destroyed = true;
+        }
+    } holder;
+
+    t_pool = &holder.pool;
+    return t_pool;
+}
+
+size_t StackAllocator::GetPageSize() {
+    static const size_t s_page_size = sysconf(_SC_PAGESIZE);
+    return s_page_size;
+}
+
+size_t StackAllocator::RoundUp(size_t size) {
+    size_t page = GetPageSize();
+    return (size + page - 1) / page * page;
+}
+
+void* StackAllocator::Alloc(size_t size) {
+    size = RoundUp(size);
+
+    StackPool* pool = GetPool();
+    if (pool) {
+        for (auto it = pool->stacks.rbegin(); it != pool->stacks.rend(); ++it) {
+            if (it->size == size) {
+                void* sp = it->sp;
+                pool->stacks.erase(std::next(it).base());
+                return sp;
+            }
+        }
+    }
+
+    size_t page = GetPageSize();
+    void* base = mmap(nullptr, size + page, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED) {
+        EVA_LOG_ERROR(g_logger) << "mmap stack size=" << size << " error: " << strerror(errno);
+        throw std::bad_alloc();
+    }
+
+    // Stacks grow downwards, the guard page sits at the lowest address.
+    if (mprotect(base, page, PROT_NONE)) {
+        EVA_LOG_ERROR(g_logger) << "mprotect guard page error: " << strerror(errno);
+        munmap(base, size + page);
+        throw std::bad_alloc();
+    }
+
+    ++s_mapped_count;
+    return (char*)base + page;
+}
+
+void StackAllocator::Dealloc(void* sp, size_t size) {
+    if (!sp) {
+        return;
+    }
+    size = RoundUp(size);
+
+    StackPool* pool = GetPool();
+    if (pool && pool->stacks.size() < MAX_POOLED_STACKS) {
+        pool->stacks.push_back({ sp, size });
+        return;
+    }
+
+    UnmapStack(sp, size);
+}
+
+size_t StackAllocator::GetPooledCount() {
+    StackPool* pool = GetPool();
+    return pool ? pool->stacks.size() : 0;
+}
+
+uint64_t StackAllocator::GetMappedCount() {
+    return s_mapped_count;
+}
+
+}
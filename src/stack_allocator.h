@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace eva01 {
+
+/**
+ * Allocator for fiber stacks.
+ *
+ * Every stack is an anonymous mmap'd region with a PROT_NONE guard page
+ * right below the usable area, so an overflow faults instead of silently
+ * corrupting the heap. Pages are only committed when the fiber touches them.
+ *
+ * Released stacks are kept in a small per-thread pool and handed out again
+ * to the next fiber of the same size created on that thread.
+ */
+class StackAllocator {
+public:
+    static void* Alloc(size_t size);
+    static void Dealloc(void* sp, size_t size);
+
+    static size_t GetPageSize();
+    static size_t RoundUp(size_t size);
+
+    // Number of stacks cached in the pool of the calling thread.
+    static size_t GetPooledCount();
+    // Number of stacks currently mapped in the process, pooled or in use.
+    static uint64_t GetMappedCount();
+};
+
+}
@@ -1,13 +1,17 @@
 #include "thread.h"
 #include "fiber.h"
+#include "log.h"
+#include <sched.h>
 
 namespace eva01 {
 
 static thread_local Thread* t_thread = nullptr;
 static thread_local std::string t_thread_name = "UNKNOWN";
 
-Thread::Thread(std::function<void()> cb, const std::string& name)
-    : m_cb(cb), m_name(name), m_semaphore(0) {
+static Logger::ptr g_logger = EVA_LOGGER("system");
+
+Thread::Thread(std::function<void()> cb, const std::string& name, const std::vector<int>& cpus)
+    : m_cb(cb), m_name(name), m_cpus(cpus), m_semaphore(0) {
 
     if (m_name.empty()) {
         m_name = "UNKNOWN";
@@ -38,6 +42,43 @@ void Thread::SetName(const std::string& name) {
     pthread_setname_np(pthread_self(), name.substr(0, 15).c_str());
 }
 
+bool Thread::SetAffinity(const std::vector<int>& cpus) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus) {
+        CPU_SET(cpu, &set);
+    }
+    return !pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+std::vector<int> Thread::GetAffinity() {
+    std::vector<int> cpus;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (pthread_getaffinity_np(pthread_self(), sizeof(set), &set)) {
+        return cpus;
+    }
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, &set)) {
+            cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+int Thread::GetCpu() {
+    return sched_getcpu();
+}
+
+int Thread::GetNumaNode() {
+    unsigned cpu = 0;
+    unsigned node = 0;
+    if (syscall(SYS_getcpu, &cpu, &node, nullptr)) {
+        return -1;
+    }
+    return (int)node;
+}
+
 void Thread::join() {
     if (m_thread) {
         if (pthread_join(m_thread, nullptr)) {
@@ -61,6 +102,10 @@ void* Thread::run(void* arg) {
 
     SetName(t_thread_name);
 
+    if (!t->m_cpus.empty() && !SetAffinity(t->m_cpus)) {
+        EVA_LOG_ERROR(g_logger) << "thread " << t->m_name << " could not be pinned";
+    }
+
     t->m_semaphore.notify();
     t->m_cb();
     return 0;
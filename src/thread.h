@@ -4,6 +4,7 @@
 #include <functional>
 #include <memory>
 #include <string>
+#include <vector>
 #include <condition_variable>
 #include <mutex>
 #include "src/util.h"
@@ -17,7 +18,9 @@ class Thread : NonCopyable {
 public:
     using ptr = std::shared_ptr<Thread>;
 
-    Thread(std::function<void()> cb, const std::string& name);
+    // A non-empty cpus pins the thread to those CPUs before cb runs.
+    Thread(std::function<void()> cb, const std::string& name,
+           const std::vector<int>& cpus = std::vector<int>());
 
     inline pid_t getId() const { return m_id; }
     inline std::string getName() const { return m_name; }
@@ -28,6 +31,13 @@ public:
     static Thread* GetThis();
     static const std::string& GetName();
     static void SetName(const std::string& name);
+    // Pin the calling thread to cpus, false if the kernel refused.
+    static bool SetAffinity(const std::vector<int>& cpus);
+    // CPUs the calling thread may run on.
+    static std::vector<int> GetAffinity();
+    // CPU and NUMA node the calling thread runs on right now.
+    static int GetCpu();
+    static int GetNumaNode();
 
 
 private:
@@ -35,6 +45,7 @@ private:
     pid_t m_id = -1;
     std::function<void()> m_cb;
     std::string m_name;
+    std::vector<int> m_cpus;
     Semaphore m_semaphore;
 
 private:
@@ -86,6 +86,18 @@ bool TimerManager::hasTimers() {
     return !m_timers.empty(); 
 }
 
+size_t TimerManager::clearTimers(std::vector<std::function<void()>>* funcs) {
+    MutexWriteGuard lk(m_mutex);
+    size_t n = m_timers.size();
+    if (funcs) {
+        for (auto& timer : m_timers) {
+            funcs->push_back(timer->m_func);
+        }
+    }
+    m_timers.clear();
+    return n;
+}
+
 void TimerManager::getExpiredFuncs(std::vector<std::function<void ()> > &funcs) {
     auto now = GetCurrentMs();
     {
@@ -60,6 +60,9 @@ public:
     uint64_t getNextTimeMs();
     void getExpiredFuncs(std::vector<std::function<void()>>& funcs);
     bool hasTimers();
+    // Remove all timers and return how many there were. Their callbacks go
+    // to funcs if given, once each, recurring or not.
+    size_t clearTimers(std::vector<std::function<void()>>* funcs = nullptr);
 
 protected:
     virtual void onFirstTimerChanged();
@@ -0,0 +1,101 @@
+#pragma once
+
+#include "src/noncopyable.h"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace eva01 {
+
+// Bounded ring of T* owned by one thread. Only the owner pushes; the owner
+// and any other thread take items from the front with a CAS on the head, so
+// a thread that ran out of work can steal half of another thread's items in
+// one go. Items come out in FIFO order, also for the owner: a fiber that
+// yields and is pushed back must not run again ahead of older work.
+template <typename T, size_t Capacity>
+class WorkStealingQueue : public NonCopyable {
+    static_assert((Capacity & (Capacity - 1)) == 0, "Capacity must be a power of 2");
+
+public:
+    WorkStealingQueue() {
+        for (auto& slot : m_slots) {
+            slot.store(nullptr, std::memory_order_relaxed);
+        }
+    }
+
+    // Owner only. false if the queue is full.
+    bool push(T* item) {
+        uint32_t head = m_head.load(std::memory_order_acquire);
+        uint32_t tail = m_tail.load(std::memory_order_relaxed);
+        if (tail - head >= Capacity) {
+            return false;
+        }
+        m_slots[tail & MASK].store(item, std::memory_order_relaxed);
+        m_tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Any thread. nullptr if the queue is empty.
+    T* pop() {
+        uint32_t head = m_head.load(std::memory_order_acquire);
+        while (true) {
+            uint32_t tail = m_tail.load(std::memory_order_acquire);
+            if (head == tail) {
+                return nullptr;
+            }
+            T* item = m_slots[head & MASK].load(std::memory_order_relaxed);
+            if (m_head.compare_exchange_weak(head, head + 1, std::memory_order_acq_rel)) {
+                return item;
+            }
+        }
+    }
+
+    // Owner of this queue only, which must be empty. Moves half of the
+    // items of victim over and returns one of them to run right away,
+    // nullptr if victim had none.
+    T* stealFrom(WorkStealingQueue& victim) {
+        uint32_t tail = m_tail.load(std::memory_order_relaxed);
+        while (true) {
+            uint32_t head = victim.m_head.load(std::memory_order_acquire);
+            uint32_t vtail = victim.m_tail.load(std::memory_order_acquire);
+            uint32_t n = vtail - head;
+            n = n - n / 2;
+            if (n == 0) {
+                return nullptr;
+            }
+            if (n > Capacity / 2) {
+                continue; // head and tail were read at different times
+            }
+            for (uint32_t i = 0; i < n; ++i) {
+                T* item = victim.m_slots[(head + i) & MASK].load(std::memory_order_relaxed);
+                m_slots[(tail + i) & MASK].store(item, std::memory_order_relaxed);
+            }
+            if (!victim.m_head.compare_exchange_weak(head, head + n, std::memory_order_acq_rel)) {
+                continue;
+            }
+            // keep the last one for the caller
+            --n;
+            T* item = m_slots[(tail + n) & MASK].load(std::memory_order_relaxed);
+            if (n) {
+                m_tail.store(tail + n, std::memory_order_release);
+            }
+            return item;
+        }
+    }
+
+    size_t size() const {
+        uint32_t head = m_head.load(std::memory_order_acquire);
+        return m_tail.load(std::memory_order_acquire) - head;
+    }
+
+    bool empty() const { return size() == 0; }
+
+private:
+    static constexpr size_t MASK = Capacity - 1;
+
+    std::atomic<uint32_t> m_head { 0 };
+    std::atomic<uint32_t> m_tail { 0 };
+    std::atomic<T*> m_slots[Capacity];
+};
+
+}
@@ -0,0 +1,240 @@
+#include <atomic>
+#include <set>
+#include <string>
+#include "src/channel.h"
+#include "src/scheduler.h"
+#include "src/thread.h"
+#include "src/util.h"
+#include "src/log.h"
+#define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+#include "doctest.h"
+
+namespace eva01 {
+
+static Logger::ptr logger = EVA_ROOT_LOGGER();
+
+TEST_CASE("Test Channel unbuffered") {
+    Scheduler sc(4, "chan");
+    sc.start();
+
+    Channel<int> ch;
+    std::atomic<long> sum { 0 };
+    for (int i = 0; i < 4; ++i) {
+        sc.schedule([&]() {
+            int v;
+            while (ch.recv(v)) {
+                sum += v;
+            }
+        });
+    }
+    for (int i = 0; i < 4; ++i) {
+        sc.schedule([&, i]() {
+            for (int j = 1; j <= 250; ++j) {
+                CHECK(ch.send(i * 250 + j));
+            }
+        });
+    }
+
+    // a plain thread waits for all values and closes the channel
+    Thread::ptr thr = std::make_shared<Thread>([&]() {
+        while (sum != 1000 * 1001 / 2) {
+            usleep(1000);
+        }
+        ch.close();
+    }, "chan_close");
+    thr->join();
+    sc.stop();
+
+    CHECK(sum == 1000 * 1001 / 2);
+    CHECK(!ch.send(1));
+}
+
+TEST_CASE("Test Channel pipeline") {
+    Scheduler sc(4, "pipe");
+    sc.start();
+
+    // parse -> process -> respond, bounded so a fast stage waits for the next
+    Channel<std::string> parsed(4);
+    Channel<int> processed(4);
+    std::atomic<size_t> max_size { 0 };
+
+    sc.schedule([&]() {
+        for (int i = 0; i < 500; ++i) {
+            parsed.send(std::to_string(i));
+            max_size = std::max<size_t>(max_size, parsed.size());
+        }
+        parsed.close();
+    });
+    std::atomic<int> workers { 3 };
+    for (int i = 0; i < 3; ++i) {
+        sc.schedule([&]() {
+            std::string s;
+            while (parsed.recv(s)) {
+                processed.send(std::stoi(s) * 2);
+            }
+            if (--workers == 0) {
+                processed.close();
+            }
+        });
+    }
+
+    long total = 0;
+    int v;
+    while (processed.recv(v)) { // drained from the test thread
+        total += v;
+    }
+    sc.stop();
+
+    CHECK(total == 2 * 499 * 500 / 2);
+    CHECK(max_size <= 4);
+}
+
+TEST_CASE("Test Channel unbounded and close") {
+    Channel<int> ch(CHANNEL_UNBOUNDED);
+    for (int i = 0; i < 10000; ++i) {
+        CHECK(ch.trySend(i));
+    }
+    ch.close();
+    CHECK(ch.size() == 10000);
+
+    int v = -1;
+    int n = 0;
+    while (ch.recv(v)) {
+        CHECK(v == n++);
+    }
+    CHECK(n == 10000);
+    CHECK(!ch.tryRecv(v));
+}
+
+TEST_CASE("Test Channel timeout") {
+    Channel<int> ch(1);
+    int v;
+
+    // plain thread
+    uint64_t start = GetCurrentMs();
+    CHECK(!ch.recv(v, 50));
+    CHECK(GetCurrentMs() - start >= 45);
+    CHECK(ch.send(1, 50));
+    CHECK(!ch.send(2, 50));
+
+    // fiber, the scheduler timer wakes it
+    Scheduler sc(1, "timeout");
+    sc.start();
+    std::atomic<bool> timed_out { false };
+    sc.schedule([&]() {
+        Channel<int> empty;
+        int x;
+        timed_out = !empty.recv(x, 50);
+    });
+    sc.stop();
+    CHECK(timed_out);
+}
+
+TEST_CASE("Test Channel shared stack fibers") {
+    // While parked, a shared stack fiber's stack is copied out and the
+    // next one runs in its place: values must not be handed over there.
+    Scheduler sc(1, "chan_shared");
+    sc.start();
+    Fiber::GetThis();
+
+    Channel<std::string> requests;
+    Channel<std::string> replies;
+    Channel<int> quit;
+    std::atomic<int> done { 0 };
+    for (int i = 0; i < 5; ++i) {
+        // receives in recv() and in a select, replies in a send that waits
+        sc.schedule(Fiber::ptr(new Fiber([&, i]() {
+            std::string req;
+            std::string guard(64, 'a' + i); // on the heap, but its pointer is not
+            CHECK(requests.recv(req));
+            int dummy = 0;
+            Select sel;
+            sel.recv(requests, req);
+            sel.recv(quit, dummy);
+            CHECK(sel.wait() == 0);
+            CHECK(replies.send(req + "!"));
+            CHECK(guard == std::string(64, 'a' + i));
+            ++done;
+        }, 0, true)));
+    }
+    SleepMs(20); // all parked in recv()
+    for (int i = 0; i < 10; ++i) {
+        CHECK(requests.send("req" + std::to_string(i)));
+    }
+    std::multiset<std::string> got;
+    for (int i = 0; i < 5; ++i) {
+        std::string reply;
+        CHECK(replies.recv(reply));
+        got.insert(reply);
+    }
+    sc.stop();
+    CHECK(done == 5);
+    REQUIRE(got.size() == 5);
+    for (auto& reply : got) {
+        CHECK(reply.size() == 5);
+        CHECK(reply.back() == '!');
+    }
+}
+
+TEST_CASE("Test Select") {
+    Scheduler sc(2, "select");
+    sc.start();
+
+    Channel<int> ints;
+    Channel<std::string> strs;
+    Channel<int> quit;
+    std::atomic<int> got_int { 0 };
+    std::atomic<int> got_str { 0 };
+    std::atomic<int> timeouts { 0 };
+
+    sc.schedule([&]() {
+        while (true) {
+            int i;
+            std::string s;
+            int q;
+            Select sel;
+            sel.recv(ints, i).recv(strs, s).recv(quit, q);
+            int r = sel.wait(1000);
+            if (r == 0) {
+                ++got_int;
+            } else if (r == 1) {
+                ++got_str;
+            } else if (r == 2) {
+                break;
+            } else {
+                ++timeouts;
+            }
+        }
+    });
+    for (int i = 0; i < 100; ++i) {
+        sc.schedule([&]() { ints.send(1); });
+        sc.schedule([&]() { strs.send("s"); });
+    }
+
+    while (got_int + got_str < 200) {
+        usleep(1000);
+    }
+    quit.send(0);
+    sc.stop();
+
+    CHECK(got_int == 100);
+    CHECK(got_str == 100);
+    CHECK(timeouts == 0);
+
+    // nothing ready
+    Select sel;
+    int v;
+    sel.recv(ints, v).send(ints, 1);
+    CHECK(sel.tryWait() == PARK_TIMED_OUT);
+    CHECK(sel.wait(20) == PARK_TIMED_OUT);
+
+    // a closed channel completes a receive with ok false
+    ints.close();
+    bool ok = true;
+    Select closed;
+    closed.recv(ints, v, &ok);
+    CHECK(closed.wait() == 0);
+    CHECK(!ok);
+}
+
+}
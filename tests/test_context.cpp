@@ -0,0 +1,186 @@
+#include <ucontext.h>
+#include <cfenv>
+#include <chrono>
+#include "src/context.h"
+#include "src/fiber.h"
+#include "src/log.h"
+#include "src/stack_allocator.h"
+#include "src/thread.h"
+#define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+#include "doctest.h"
+
+namespace eva01 {
+
+static Logger::ptr logger = EVA_ROOT_LOGGER();
+
+constexpr const size_t BENCH_STACK_SIZE = 64 * 1024;
+constexpr const int BENCH_ROUNDS = 1000000;
+
+static Context s_main_ctx;
+static Context s_ctx;
+static int s_counter = 0;
+static bool s_running = false; // the other context loops while set
+static bool s_finished = false;
+
+// A context function must not return: it leaves its loop and switches back
+// for the last time, its stack can go then.
+static void ping() {
+    while (s_running) {
+        ++s_counter;
+        SwapContext(&s_ctx, &s_main_ctx);
+    }
+    s_finished = true;
+    SwapContext(&s_ctx, &s_main_ctx);
+}
+
+// Changes the FP state that is saved with a context.
+static void fp_ping() {
+    while (s_running) {
+#if !defined(EVA01_USE_UCONTEXT) && defined(__aarch64__)
+        asm volatile("fmov d8, xzr" ::: "d8"); // callee-saved
+#else
+        fesetround(FE_UPWARD); // mxcsr and the x87 control word
+#endif
+        SwapContext(&s_ctx, &s_main_ctx);
+    }
+    s_finished = true;
+    SwapContext(&s_ctx, &s_main_ctx);
+}
+
+// Start the other context on stack.
+static void startPing(void* stack, ContextFunc func) {
+    s_running = true;
+    s_finished = false;
+    MakeContext(&s_ctx, stack, BENCH_STACK_SIZE, func);
+}
+
+// Let the other context run to its end.
+static void finishPing() {
+    s_running = false;
+    SwapContext(&s_main_ctx, &s_ctx);
+    CHECK(s_finished);
+}
+
+static ucontext_t s_main_uctx;
+static ucontext_t s_uctx;
+
+static void uping() {
+    while (s_running) {
+        swapcontext(&s_uctx, &s_main_uctx);
+    }
+    s_finished = true;
+    swapcontext(&s_uctx, &s_main_uctx);
+}
+
+static void report(const char* name, int rounds, std::chrono::steady_clock::duration d) {
+    double secs = std::chrono::duration<double>(d).count();
+    // every round is one switch in and one switch out
+    EVA_LOG_INFO(logger) << name << ": " << (uint64_t)(rounds * 2 / secs) << " switches/s";
+}
+
+TEST_CASE("Test Context switch") {
+    void* stack = StackAllocator::Alloc(BENCH_STACK_SIZE);
+    startPing(stack, &ping);
+
+    s_counter = 0;
+    for (int i = 0; i < 10; ++i) {
+        SwapContext(&s_main_ctx, &s_ctx);
+        CHECK(s_counter == i + 1);
+    }
+    finishPing();
+    StackAllocator::Dealloc(stack, BENCH_STACK_SIZE);
+}
+
+TEST_CASE("Test Context FP state") {
+    // The other context changes the FP state every time it runs, ours has
+    // to be back after each switch.
+    void* stack = StackAllocator::Alloc(BENCH_STACK_SIZE);
+    startPing(stack, &fp_ping);
+#if !defined(EVA01_USE_UCONTEXT) && defined(__aarch64__)
+    register double d8 asm("d8") = 1.5;
+    for (int i = 0; i < 3; ++i) {
+        asm volatile("" : "+w"(d8));
+        SwapContext(&s_main_ctx, &s_ctx);
+        asm volatile("" : "+w"(d8));
+        CHECK(d8 == 1.5);
+    }
+#else
+    fesetround(FE_TONEAREST);
+    for (int i = 0; i < 3; ++i) {
+        SwapContext(&s_main_ctx, &s_ctx);
+        CHECK(fegetround() == FE_TONEAREST);
+#if defined(__x86_64__)
+        unsigned short cw = 0;
+        asm volatile("fnstcw %0" : "=m"(cw));
+        CHECK((cw & 0xC00) == 0); // x87 rounding to nearest
+#endif
+    }
+#endif
+    finishPing();
+    StackAllocator::Dealloc(stack, BENCH_STACK_SIZE);
+}
+
+TEST_CASE("Benchmark Context switch") {
+    EVA_LOG_INFO(logger) << "context backend: " << GetContextBackend();
+
+    void* stack = StackAllocator::Alloc(BENCH_STACK_SIZE);
+    startPing(stack, &ping);
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < BENCH_ROUNDS; ++i) {
+        SwapContext(&s_main_ctx, &s_ctx);
+    }
+    report(GetContextBackend(), BENCH_ROUNDS, std::chrono::steady_clock::now() - start);
+    finishPing();
+    StackAllocator::Dealloc(stack, BENCH_STACK_SIZE);
+
+    void* ustack = StackAllocator::Alloc(BENCH_STACK_SIZE);
+    getcontext(&s_uctx);
+    s_uctx.uc_link = nullptr;
+    s_uctx.uc_stack.ss_sp = ustack;
+    s_uctx.uc_stack.ss_size = BENCH_STACK_SIZE;
+    makecontext(&s_uctx, &uping, 0);
+    s_running = true;
+    s_finished = false;
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < BENCH_ROUNDS; ++i) {
+        swapcontext(&s_main_uctx, &s_uctx);
+    }
+    report("ucontext", BENCH_ROUNDS, std::chrono::steady_clock::now() - start);
+    s_running = false;
+    swapcontext(&s_main_uctx, &s_uctx);
+    CHECK(s_finished);
+    StackAllocator::Dealloc(ustack, BENCH_STACK_SIZE);
+
+    Thread::ptr thr = std::make_shared<Thread>([]() {
+        Fiber::GetThis();
+        Fiber::ptr fiber(new Fiber([]() {
+            while (true) {
+                Fiber::YieldReady();
+            }
+        }));
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < BENCH_ROUNDS; ++i) {
+            fiber->call();
+        }
+        report("Fiber call/yield", BENCH_ROUNDS, std::chrono::steady_clock::now() - start);
+
+        // ping-pong between two fibers, handing control over directly
+        Fiber::ptr pong;
+        Fiber::ptr ping(new Fiber([&]() {
+            for (int i = 0; i < BENCH_ROUNDS; ++i) {
+                Fiber::TransferTo(pong);
+            }
+        }));
+        pong.reset(new Fiber([&]() {
+            while (true) {
+                Fiber::TransferTo(ping);
+            }
+        }));
+        start = std::chrono::steady_clock::now();
+        ping->call();
+        report("Fiber transfer", BENCH_ROUNDS, std::chrono::steady_clock::now() - start);
+    }, "bench");
+    thr->join();
+}
+
+}
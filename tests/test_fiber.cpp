@@ -1,6 +1,7 @@
 #include <iostream>
 #include "src/thread.h"
 #include "src/fiber.h"
+#include "src/stack_allocator.h"
 #include "src/log.h"
 #include "src/util.h"
 #define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
@@ -52,4 +53,188 @@ TEST_CASE("Test Fiber") {
     thr->join();
 }
 
+TEST_CASE("Test Fiber stack pool") {
+    eva01::Thread::ptr thr = std::make_shared<eva01::Thread>([]() {
+        // other tests map stacks of their own, only the changes count
+        uint64_t mapped = StackAllocator::GetMappedCount();
+        Fiber::GetThis();
+        // the main fiber runs on the thread stack
+        CHECK(StackAllocator::GetMappedCount() == mapped);
+        CHECK(StackAllocator::GetPooledCount() == 0);
+
+        {
+            Fiber::ptr f1(new Fiber(&fiber1));
+            CHECK(StackAllocator::GetMappedCount() == mapped + 1);
+            while (f1->getState() != Fiber::TERM) {
+                f1->call();
+            }
+        }
+        CHECK(StackAllocator::GetPooledCount() == 1);
+
+        // the released stack is reused by the next fiber on this thread
+        Fiber::ptr f2(new Fiber(&fiber2));
+        CHECK(StackAllocator::GetPooledCount() == 0);
+        CHECK(StackAllocator::GetMappedCount() == mapped + 1);
+        while (f2->getState() != Fiber::TERM) {
+            f2->call();
+        }
+    }, "pool");
+    thr->join();
+}
+
+}
+
+namespace eva01 {
+
+static void deep(int depth) {
+    volatile char buf[1024];
+    buf[0] = (char)depth;
+    if (depth > 0) {
+        deep(depth - 1);
+    }
+    (void)buf[0];
+}
+
+TEST_CASE("Test Fiber stack size") {
+    eva01::Thread::ptr thr = std::make_shared<eva01::Thread>([]() {
+        Fiber::GetThis();
+
+        Fiber::ptr f1(new Fiber(&fiber1));
+        CHECK(f1->getStackSize() == DEFAULT_STACK_SIZE);
+
+        Fiber::ptr f2(new Fiber([]() { deep(16); }, 64 * 1024));
+        CHECK(f2->getStackSize() == 64 * 1024);
+        f2->call();
+        CHECK(f2->getState() == Fiber::TERM);
+
+#ifdef EVA01_STACK_WATERMARK
+        CHECK(f2->getStackHighWater() > 16 * 1024);
+        CHECK(f2->getStackHighWater() < 64 * 1024);
+        CHECK(Fiber::GetMaxStackHighWater() >= f2->getStackHighWater());
+#else
+        CHECK(f2->getStackHighWater() == 0);
+#endif
+    }, "stacksize");
+    thr->join();
+}
+
+}
+
+namespace eva01 {
+
+TEST_CASE("Test Fiber shared stack") {
+    eva01::Thread::ptr thr = std::make_shared<eva01::Thread>([]() {
+        Fiber::GetThis();
+        uint64_t mapped = StackAllocator::GetMappedCount();
+
+        const int num = 1000;
+        std::vector<int> results(num, 0);
+        std::vector<Fiber::ptr> fibers;
+        for (int i = 0; i < num; ++i) {
+            fibers.emplace_back(new Fiber([i, &results]() {
+                int local[16];
+                for (int j = 0; j < 16; ++j) {
+                    local[j] = i + j;
+                }
+                Fiber::Yield();
+                int sum = 0;
+                for (int j = 0; j < 16; ++j) {
+                    sum += local[j] - j;
+                }
+                results[i] = sum / 16;
+            }, 0, true));
+        }
+
+        // park all of them, each keeps only its live frames aside
+        for (auto& f : fibers) {
+            f->call();
+            CHECK(f->getState() == Fiber::SUSPEND);
+            CHECK(f->getHomeThread() == GetThreadId());
+            CHECK(f->getSavedStackSize() > 0);
+            CHECK(f->getSavedStackSize() < 16 * 1024);
+        }
+        // one execution stack for the whole thread
+        CHECK(StackAllocator::GetMappedCount() == mapped + 1);
+        CHECK(Fiber::GetBoundCount() == (size_t)num);
+
+        for (auto& f : fibers) {
+            f->call();
+            CHECK(f->getState() == Fiber::TERM);
+            CHECK(f->getSavedStackSize() == 0);
+            CHECK(f->getHomeThread() == 0);
+        }
+        CHECK(Fiber::GetBoundCount() == 0);
+
+        // bound again once reset and called
+        fibers[0]->reset([]() { Fiber::Yield(); });
+        fibers[0]->call();
+        CHECK(Fiber::GetBoundCount() == 1);
+        fibers[0]->call();
+        CHECK(Fiber::GetBoundCount() == 0);
+        for (int i = 0; i < num; ++i) {
+            CHECK(results[i] == i);
+        }
+    }, "shared");
+    thr->join();
+}
+
+}
+
+namespace eva01 {
+
+TEST_CASE("Test Fiber TransferTo") {
+    eva01::Thread::ptr thr = std::make_shared<eva01::Thread>([]() {
+        Fiber::GetThis();
+
+        for (bool shared : { false, true }) {
+            std::vector<int> trace;
+            Fiber::ptr consumer;
+            Fiber::ptr producer(new Fiber([&]() {
+                for (int i = 0; i < 3; ++i) {
+                    trace.push_back(i);
+                    Fiber::TransferTo(consumer);
+                }
+            }));
+            consumer.reset(new Fiber([&]() {
+                while (true) {
+                    trace.push_back(-trace.back());
+                    Fiber::TransferTo(producer);
+                }
+            }, 0, shared));
+
+            producer->call();
+            // the producer finished and came back, the consumer is parked
+            CHECK(producer->getState() == Fiber::TERM);
+            CHECK(consumer->getState() == Fiber::SUSPEND);
+            CHECK(Fiber::TakeReturned() == nullptr);
+            CHECK(trace == std::vector<int>({ 0, 0, 1, -1, 2, -2 }));
+        }
+
+        // the fiber handed to is the one that comes back
+        Fiber::ptr second(new Fiber([]() { Fiber::Yield(); }));
+        Fiber::ptr first(new Fiber([&]() { Fiber::TransferTo(second); }));
+        first->call();
+        CHECK(first->getState() == Fiber::SUSPEND);
+        CHECK(Fiber::TakeReturned() == second);
+    }, "transfer");
+    thr->join();
+}
+
+TEST_CASE("Test Fiber exception") {
+    Thread::ptr thr = std::make_shared<Thread>([]() {
+        Fiber::GetThis();
+        Fiber::ptr fiber(new Fiber([]() { throw 7; }));
+        fiber->call();
+        CHECK(fiber->getState() == Fiber::EXCEPT);
+        REQUIRE(fiber->getException());
+        CHECK_THROWS_AS(std::rethrow_exception(fiber->getException()), int);
+
+        fiber->reset([]() {});
+        CHECK(!fiber->getException());
+        fiber->call();
+        CHECK(fiber->getState() == Fiber::TERM);
+    }, "except");
+    thr->join();
+}
+
 }
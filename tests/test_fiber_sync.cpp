@@ -0,0 +1,215 @@
+#include <atomic>
+#include <cstring>
+#include "src/fiber_sync.h"
+#include "src/scheduler.h"
+#include "src/thread.h"
+#include "src/log.h"
+#include "src/util.h"
+#define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+#include "doctest.h"
+
+namespace eva01 {
+
+static Logger::ptr logger = EVA_ROOT_LOGGER();
+
+TEST_CASE("Test FiberMutex") {
+    Scheduler sc(4, "fmutex");
+    sc.start();
+
+    FiberMutex mtx;
+    int counter = 0;
+    for (int i = 0; i < 200; ++i) {
+        sc.schedule([&]() {
+            for (int j = 0; j < 10; ++j) {
+                mtx.lock();
+                int v = counter;
+                Fiber::YieldReady(); // give others the chance to contend
+                counter = v + 1;
+                mtx.unlock();
+            }
+        });
+    }
+
+    // a plain thread shares the lock with the fibers
+    Thread::ptr thr = std::make_shared<Thread>([&]() {
+        for (int j = 0; j < 100; ++j) {
+            mtx.lock();
+            ++counter;
+            mtx.unlock();
+        }
+    }, "fmutex_thr");
+    thr->join();
+    sc.stop();
+
+    CHECK(counter == 2100);
+    CHECK(mtx.tryLock());
+    mtx.unlock();
+}
+
+TEST_CASE("Test FiberSemaphore does not block the thread") {
+    // With a single thread, a thread blocking primitive would deadlock here.
+    Scheduler sc(1, "fsem");
+    sc.start();
+
+    FiberSemaphore sem;
+    std::atomic<int> done { 0 };
+    for (int i = 0; i < 10; ++i) {
+        sc.schedule([&]() {
+            sem.wait();
+            ++done;
+        });
+    }
+    sc.schedule([&]() {
+        for (int i = 0; i < 10; ++i) {
+            sem.notify();
+        }
+    });
+    sc.stop();
+
+    CHECK(done == 10);
+    CHECK(sem.getCount() == 0);
+}
+
+TEST_CASE("Test shared stack fibers park") {
+    // Parked shared stack fibers have their stacks copied out while the
+    // others run in the same place, so nothing of a waiter may live there.
+    Scheduler sc(1, "fshared");
+    sc.start();
+    Fiber::GetThis();
+
+    FiberSemaphore sem;
+    FiberMutex mtx;
+    std::atomic<int> done { 0 };
+    int counter = 0;
+    for (int i = 0; i < 10; ++i) {
+        sc.schedule(Fiber::ptr(new Fiber([&, i]() {
+            char scratch[256]; // something for the next fiber to overwrite
+            memset(scratch, i, sizeof(scratch));
+            sem.wait();
+            for (int j = 0; j < 10; ++j) {
+                mtx.lock();
+                int v = counter;
+                Fiber::YieldReady();
+                counter = v + 1;
+                mtx.unlock();
+            }
+            CHECK(scratch[255] == (char)i);
+            ++done;
+        }, 0, true)));
+    }
+    // all of them parked, woken from outside of the scheduler
+    while (sc.getQueueDepth(Scheduler::NORMAL_PRIORITY)) {
+        SleepMs(1);
+    }
+    SleepMs(10);
+    for (int i = 0; i < 10; ++i) {
+        sem.notify();
+    }
+    sc.stop();
+    CHECK(done == 10);
+    CHECK(counter == 100);
+}
+
+TEST_CASE("Test FiberSemaphore limits concurrency") {
+    Scheduler sc(4, "flimit");
+    sc.start();
+
+    FiberSemaphore sem(2);
+    std::atomic<int> inside { 0 };
+    std::atomic<int> max_inside { 0 };
+    for (int i = 0; i < 100; ++i) {
+        sc.schedule([&]() {
+            sem.wait();
+            int n = ++inside;
+            int m = max_inside;
+            while (n > m && !max_inside.compare_exchange_weak(m, n)) {
+            }
+            Fiber::YieldReady();
+            --inside;
+            sem.notify();
+        });
+    }
+    sc.stop();
+
+    CHECK(max_inside <= 2);
+    CHECK(sem.getCount() == 2);
+}
+
+TEST_CASE("Test FiberCondVar") {
+    Scheduler sc(2, "fcond");
+    sc.start();
+
+    FiberMutex mtx;
+    FiberCondVar cond;
+    std::vector<int> items;
+    int consumed = 0;
+
+    for (int i = 0; i < 4; ++i) {
+        sc.schedule([&]() {
+            for (int j = 0; j < 250; ++j) {
+                mtx.lock();
+                cond.wait(mtx, [&]() { return !items.empty(); });
+                items.pop_back();
+                ++consumed;
+                mtx.unlock();
+            }
+        });
+    }
+
+    // producer is a plain thread
+    Thread::ptr thr = std::make_shared<Thread>([&]() {
+        for (int i = 0; i < 1000; ++i) {
+            mtx.lock();
+            items.push_back(i);
+            cond.notify();
+            mtx.unlock();
+        }
+    }, "fcond_thr");
+    thr->join();
+    sc.stop();
+
+    CHECK(consumed == 1000);
+    CHECK(items.empty());
+}
+
+TEST_CASE("Test FiberRWMutex") {
+    Scheduler sc(4, "frw");
+    sc.start();
+
+    FiberRWMutex mtx;
+    std::atomic<int> readers { 0 };
+    std::atomic<int> max_readers { 0 };
+    std::atomic<int> bad { 0 };
+    int value = 0;
+
+    for (int i = 0; i < 100; ++i) {
+        if (i % 10 == 0) {
+            sc.schedule([&]() {
+                WriteGuard<FiberRWMutex> lk(mtx);
+                if (readers != 0) {
+                    ++bad;
+                }
+                int v = value;
+                Fiber::YieldReady();
+                value = v + 1;
+            });
+        } else {
+            sc.schedule([&]() {
+                ReadGuard<FiberRWMutex> lk(mtx);
+                int n = ++readers;
+                int m = max_readers;
+                while (n > m && !max_readers.compare_exchange_weak(m, n)) {
+                }
+                Fiber::YieldReady();
+                --readers;
+            });
+        }
+    }
+    sc.stop();
+
+    CHECK(bad == 0);
+    CHECK(value == 10);
+    EVA_LOG_INFO(logger) << "max concurrent readers: " << max_readers;
+}
+
+}
@@ -0,0 +1,145 @@
+#include <atomic>
+#include <cstring>
+#include <stdexcept>
+#include "src/future.h"
+#include "src/scheduler.h"
+#include "src/thread.h"
+#include "src/util.h"
+#include "src/log.h"
+#define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+#include "doctest.h"
+
+namespace eva01 {
+
+static Logger::ptr logger = EVA_ROOT_LOGGER();
+
+TEST_CASE("Test async") {
+    Scheduler sc(2, "async");
+    sc.start();
+
+    Future<int> f = sc.async([]() { return 42; });
+    Future<void> v = sc.async([]() {});
+    Future<std::string> s = sc.async([]() -> std::string { throw std::runtime_error("boom"); });
+
+    CHECK(f.get() == 42); // from the test thread
+    v.get();
+    CHECK_THROWS_WITH_AS(s.get(), "boom", std::runtime_error);
+    CHECK(f.isReady());
+    sc.stop();
+}
+
+TEST_CASE("Test Future get parks the fiber") {
+    // One thread: a get() that blocked the thread would never see its result.
+    Scheduler sc(1, "fanout");
+    sc.start();
+
+    Future<long> total = sc.async([]() {
+        Scheduler* sched = Scheduler::GetThis();
+        std::vector<Future<long>> parts;
+        for (long i = 0; i < 10; ++i) {
+            parts.push_back(sched->async([i]() {
+                Fiber::YieldReady();
+                return i * 100;
+            }));
+        }
+        WhenAll(parts).get();
+        long sum = 0;
+        for (auto& p : parts) {
+            CHECK(p.isReady());
+            sum += p.get();
+        }
+        return sum;
+    });
+    CHECK(total.get() == 4500);
+    sc.stop();
+}
+
+TEST_CASE("Test Future get from shared stack fibers") {
+    // Parked shared stack fibers have their stacks copied out: whoever sets
+    // the value must not touch the waiter there.
+    Scheduler sc(1, "future_shared");
+    sc.start();
+    Fiber::GetThis();
+
+    std::vector<Promise<int>> promises(8);
+    std::vector<Future<int>> futures;
+    for (auto& p : promises) {
+        futures.push_back(p.getFuture());
+    }
+    std::atomic<int> sum { 0 };
+    std::atomic<int> done { 0 };
+    for (int i = 0; i < 8; ++i) {
+        sc.schedule(Fiber::ptr(new Fiber([&, i]() {
+            char scratch[256];
+            memset(scratch, i, sizeof(scratch));
+            if (i % 2) {
+                sum += futures[i].get();
+            } else {
+                WhenAll(futures).get();
+                sum += futures[i].get();
+            }
+            for (char c : scratch) {
+                CHECK(c == (char)i);
+            }
+            ++done;
+        }, 0, true)));
+    }
+    SleepMs(20); // all parked
+    for (int i = 0; i < 8; ++i) {
+        promises[i].setValue(i);
+    }
+    sc.stop();
+    CHECK(done == 8);
+    CHECK(sum == 28);
+}
+
+TEST_CASE("Test WhenAll exception") {
+    Scheduler sc(2, "whenall");
+    sc.start();
+
+    std::vector<Future<int>> parts;
+    parts.push_back(sc.async([]() { return 1; }));
+    parts.push_back(sc.async([]() -> int { throw std::logic_error("bad"); }));
+    parts.push_back(sc.async([]() { return 3; }));
+    CHECK_THROWS_AS(WhenAll(parts).get(), std::logic_error);
+    CHECK(parts[0].get() == 1);
+    CHECK(parts[2].get() == 3);
+
+    // nothing to wait for
+    CHECK(WhenAll(std::vector<Future<int>>()).isReady());
+    sc.stop();
+}
+
+TEST_CASE("Test WaitGroup") {
+    Scheduler sc(4, "wg");
+    sc.start();
+
+    WaitGroup wg;
+    std::atomic<int> done { 0 };
+    wg.add(100);
+    for (int i = 0; i < 100; ++i) {
+        sc.schedule([&]() {
+            Fiber::YieldReady();
+            ++done;
+            wg.done();
+        });
+    }
+    wg.wait();
+    CHECK(done == 100);
+
+    // waited on from a fiber as well
+    std::atomic<bool> joined { false };
+    sc.schedule([&]() {
+        WaitGroup inner;
+        inner.add(10);
+        for (int i = 0; i < 10; ++i) {
+            Scheduler::GetThis()->schedule([&]() { inner.done(); });
+        }
+        inner.wait();
+        joined = true;
+    });
+    sc.stop();
+    CHECK(joined);
+}
+
+}
@@ -1,5 +1,6 @@
 #include "src/log.h"
 #include "src/iomanager.h"
+#include "src/thread.h"
 #include "src/timer.h"
 #include "src/util.h"
 #include <sys/types.h>
@@ -9,6 +10,8 @@
 #include <unistd.h>
 #include <sys/epoll.h>
 #include <string.h>
+#include <atomic>
+#include <chrono>
 #define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
 #include "doctest.h"
 
@@ -22,10 +25,7 @@ void sleepf(uint64_t secs) {
     Fiber::ptr fiber = Fiber::GetThis();
     IOManager* iom = IOManager::GetThis();
 
-    iom->addTimer(secs * 1000, std::bind(
-                (void(eva01::Scheduler::*)
-        (eva01::Fiber::ptr, int thread))&eva01::IOManager::schedule
-        ,iom, fiber, -1));
+    iom->addTimer(secs * 1000, [iom, fiber]() { iom->schedule(fiber); });
     Fiber::Yield();
     return;
 }
@@ -80,4 +80,96 @@ TEST_CASE("Test IOManager") {
     iom.schedule(funcs.begin(), funcs.end());
 }
 
+TEST_CASE("Test Sharded Reactor") {
+    for (auto mode : { Scheduler::ROUND_ROBIN_REACTOR, Scheduler::CALLER_REACTOR }) {
+        IOManager iom(4, "reactor", mode);
+        CHECK(iom.getReactorMode() == mode);
+
+        constexpr int N = 64;
+        int fds[N][2];
+        std::atomic<int> added { 0 };
+        std::atomic<int> done { 0 };
+        for (int i = 0; i < N; ++i) {
+            REQUIRE(!pipe(fds[i]));
+            int rfd = fds[i][0];
+            iom.schedule([&, rfd]() {
+                IOManager::GetThis()->addEvent(rfd, IOManager::READ, [&, rfd]() {
+                    char c;
+                    CHECK(read(rfd, &c, 1) == 1);
+                    ++done;
+                });
+                ++added;
+            });
+        }
+        while (added != N) {
+            usleep(1000);
+        }
+
+        // every worker waits on its own epoll, the events still arrive at once
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < N; ++i) {
+            CHECK(write(fds[i][1], "x", 1) == 1);
+        }
+        while (done != N && std::chrono::steady_clock::now() - start < std::chrono::seconds(2)) {
+            usleep(1000);
+        }
+        CHECK(done == N);
+        CHECK(std::chrono::steady_clock::now() - start < std::chrono::seconds(1));
+
+        // timers are still served by one of them
+        std::atomic<bool> fired { false };
+        iom.addTimer(20, [&]() { fired = true; });
+        iom.stop();
+        CHECK(fired);
+
+        for (int i = 0; i < N; ++i) {
+            close(fds[i][0]);
+            close(fds[i][1]);
+        }
+    }
+}
+
+TEST_CASE("Test Round Robin Reactor with caller") {
+    // The caller only polls from stop(): its epoll must not get fds.
+    Thread::ptr thr = std::make_shared<Thread>([]() {
+        IOManager iom(2, "rr_caller", Scheduler::ROUND_ROBIN_REACTOR, true);
+
+        constexpr int N = 8;
+        int fds[N][2];
+        std::atomic<int> added { 0 };
+        std::atomic<int> done { 0 };
+        for (int i = 0; i < N; ++i) {
+            REQUIRE(!pipe(fds[i]));
+            int rfd = fds[i][0];
+            iom.schedule([&, rfd]() {
+                CHECK(IOManager::GetThis()->addEvent(rfd, IOManager::READ, [&, rfd]() {
+                    char c;
+                    CHECK(read(rfd, &c, 1) == 1);
+                    ++done;
+                }));
+                ++added;
+            });
+        }
+        while (added != N) {
+            usleep(1000);
+        }
+        for (int i = 0; i < N; ++i) {
+            CHECK(write(fds[i][1], "x", 1) == 1);
+        }
+        for (int i = 0; i < 2000 && done != N; ++i) {
+            usleep(1000);
+        }
+        CHECK(done == N);
+        iom.stop();
+
+        // nowhere to watch it any more
+        CHECK(!iom.addEvent(fds[0][0], IOManager::READ, []() {}));
+        for (int i = 0; i < N; ++i) {
+            close(fds[i][0]);
+            close(fds[i][1]);
+        }
+    }, "rr_caller");
+    thr->join();
+}
+
 }
@@ -0,0 +1,80 @@
+// Built only with -DEVA01_PREEMPT_INSTRUMENT=ON, and with -finstrument-functions:
+// every function entry of this file is a safe point.
+#include <atomic>
+#include <chrono>
+#include "src/scheduler.h"
+#include "src/fiber.h"
+#include "src/log.h"
+#define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+#include "doctest.h"
+
+
+static eva01::Logger::ptr logger = EVA_ROOT_LOGGER();
+
+__attribute__((noinline))
+static uint64_t Step(uint64_t x) {
+    return x * 6364136223846793005ULL + 1442695040888963407ULL;
+}
+
+// A CPU loop without a single MaybeYield() call of its own.
+static uint64_t Spin(int ms) {
+    uint64_t x = 0;
+    auto end = std::chrono::steady_clock::now() + std::chrono::milliseconds(ms);
+    while (std::chrono::steady_clock::now() < end) {
+        x = Step(x);
+    }
+    return x;
+}
+
+TEST_CASE("Test Preempt At Function Entry") {
+    eva01::Scheduler sc(1, "preempt");
+    sc.setTimeSlice(10);
+    sc.start();
+
+    std::atomic<bool> other { false };
+    std::atomic<bool> other_during { false };
+    std::atomic<uint64_t> sink { 0 };
+    sc.schedule([&]() {
+        sink += Spin(200);
+        other_during = (bool)other;
+    });
+    sc.schedule([&]() { other = true; });
+    sc.stop();
+
+    CHECK(other_during);
+    // more than one: the hook is not left disabled after a yield
+    CHECK(sc.getPreemptCount() > 1);
+    CHECK(sc.getPreemptRequests() >= sc.getPreemptCount());
+    EVA_LOG_INFO(logger) << "requests=" << sc.getPreemptRequests()
+                         << " yields=" << sc.getPreemptCount();
+}
+
+TEST_CASE("Test Preempt Across Threads") {
+    // preempted fibers go on on either worker
+    eva01::Scheduler sc(2, "preempt");
+    sc.setTimeSlice(10);
+    sc.start();
+
+    std::atomic<int> loops { 0 };
+    std::atomic<int> shorts { 0 };
+    std::atomic<int> shorts_during { 0 };
+    std::atomic<uint64_t> sink { 0 };
+    for (int i = 0; i < 4; ++i) {
+        sc.schedule([&]() {
+            sink += Spin(100);
+            if (++loops == 1) {
+                shorts_during = (int)shorts;
+            }
+        });
+    }
+    for (int i = 0; i < 8; ++i) {
+        sc.schedule([&]() { ++shorts; });
+    }
+    sc.stop();
+
+    CHECK(loops == 4);
+    CHECK(shorts_during == 8);
+    CHECK(sc.getPreemptCount() > 4);
+    EVA_LOG_INFO(logger) << "requests=" << sc.getPreemptRequests()
+                         << " yields=" << sc.getPreemptCount();
+}
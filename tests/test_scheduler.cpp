@@ -1,6 +1,16 @@
 #include <iostream>
+#include <algorithm>
+#include <array>
+#include <memory>
+#include <set>
+#include <chrono>
+#include <stdexcept>
+#include <future>
+#include <poll.h>
 #include "src/scheduler.h"
+#include "src/fiber_sync.h"
 #include "src/log.h"
+#include "src/thread.h"
 #include "src/timer.h"
 #include "src/util.h"
 #define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
@@ -40,6 +50,858 @@ TEST_CASE("Test Fiber") {
     sc.stop();
 }
 
+TEST_CASE("Test Stack Size") {
+    eva01::Scheduler sc(2, "stack");
+    CHECK(sc.getStackSize() == DEFAULT_STACK_SIZE);
+    sc.setStackSize(128 * 1024);
+    sc.start();
+
+    std::atomic<size_t> small { 0 };
+    std::atomic<size_t> dflt { 0 };
+    sc.schedule([&]() { small = Fiber::GetThis()->getStackSize(); }, -1, 32 * 1024);
+    sc.schedule([&]() { dflt = Fiber::GetThis()->getStackSize(); });
+    sc.stop();
+
+    CHECK(small == 32 * 1024);
+    CHECK(dflt == 128 * 1024);
+}
+
+TEST_CASE("Test Fiber Pool") {
+    eva01::Scheduler sc(1, "pool");
+    sc.start();
+
+    std::atomic<int> done { 0 };
+    for (int i = 0; i < 100; ++i) {
+        sc.schedule([&]() { ++done; });
+    }
+    for (int i = 0; i < 100; ++i) {
+        sc.schedule([&]() {
+            // give up the thread once, the fiber comes back as a fiber task
+            Fiber::YieldReady();
+            ++done;
+        });
+    }
+    sc.stop();
+
+    CHECK(done == 200);
+    CHECK(sc.getFiberPoolHits() + sc.getFiberPoolMisses() == 200);
+    // one fiber serves all tasks that do not suspend
+    CHECK(sc.getFiberPoolMisses() <= 100);
+    CHECK(sc.getFiberPoolHits() >= 99);
+}
+
+TEST_CASE("Test Shared Stack Fiber") {
+    eva01::Scheduler sc(4, "shared");
+    sc.start();
+
+    std::atomic<int> moved { 0 };
+    std::atomic<int> done { 0 };
+    Fiber::GetThis();
+    for (int i = 0; i < 100; ++i) {
+        sc.schedule(Fiber::ptr(new Fiber([&]() {
+            pid_t home = GetThreadId();
+            for (int j = 0; j < 10; ++j) {
+                Fiber::YieldReady();
+                if (GetThreadId() != home) {
+                    ++moved;
+                }
+            }
+            ++done;
+        }, 0, true)));
+    }
+    sc.stop();
+
+    CHECK(done == 100);
+    CHECK(moved == 0);
+}
+
+TEST_CASE("Test Schedule Next") {
+    eva01::Scheduler sc(1, "next");
+    sc.start();
+
+    std::vector<std::string> order;
+    Mutex mtx;
+    auto record = [&](const std::string& name) {
+        MutexGuard<Mutex> lk(mtx);
+        order.push_back(name);
+    };
+
+    sc.schedule([&]() {
+        Fiber::ptr woken(new Fiber([&]() { record("next"); }));
+        Scheduler::GetThis()->schedule([&]() { record("queued"); });
+        Scheduler::GetThis()->scheduleNext(woken);
+        record("first");
+    });
+    sc.stop();
+
+    CHECK(order == std::vector<std::string>({ "first", "next", "queued" }));
+}
+
+TEST_CASE("Test Move-only Task") {
+    eva01::Scheduler sc(2, "moveonly");
+    sc.start();
+
+    std::atomic<int> sum { 0 };
+    std::unique_ptr<int> small(new int(1));
+    sc.schedule([&sum, p = std::move(small)]() { sum += *p; });
+
+    // too big for the inline buffer, kept on the heap
+    std::array<char, 256> big;
+    big.fill(2);
+    std::unique_ptr<int> boxed(new int(3));
+    sc.schedule([&sum, big, p = std::move(boxed)]() { sum += big[255] + *p; });
+
+    Future<int> f = sc.async([p = std::unique_ptr<int>(new int(4))]() { return *p; });
+    CHECK(f.get() == 4);
+    sc.stop();
+    CHECK(sum == 1 + 2 + 3);
+
+    InlineFunction empty = std::function<void()>();
+    CHECK(!empty);
+    InlineFunction inl([&sum]() { ++sum; });
+    InlineFunction heap([&sum, big]() { sum += big[0]; });
+    CHECK(!inl.isHeap());
+    CHECK(heap.isHeap());
+    InlineFunction moved = std::move(inl);
+    moved();
+    heap();
+    CHECK(sum == 6 + 1 + 2);
+}
+
+TEST_CASE("Test Priority Lanes") {
+    eva01::Scheduler sc(1, "lanes");
+    CHECK(sc.getPriorityWeight(Scheduler::HIGH_PRIORITY) == 8);
+    sc.setPriorityWeight(Scheduler::BACKGROUND_PRIORITY, 2);
+    sc.start();
+
+    std::vector<Scheduler::Priority> order;
+    size_t depth[Scheduler::PRIORITY_COUNT] = { 0 };
+    // queued all at once from a task, nothing runs in between
+    sc.schedule([&]() {
+        Scheduler* sched = Scheduler::GetThis();
+        for (int i = 0; i < 100; ++i) {
+            sched->schedule([&]() { order.push_back(Scheduler::BACKGROUND_PRIORITY); },
+                            Scheduler::BACKGROUND_PRIORITY);
+            sched->schedule([&]() { order.push_back(Scheduler::NORMAL_PRIORITY); });
+        }
+        for (int i = 0; i < 10; ++i) {
+            sched->schedule([&]() { order.push_back(Scheduler::HIGH_PRIORITY); },
+                            Scheduler::HIGH_PRIORITY);
+        }
+        for (int i = 0; i < Scheduler::PRIORITY_COUNT; ++i) {
+            depth[i] = sched->getQueueDepth((Scheduler::Priority)i);
+        }
+    });
+    sc.stop();
+
+    CHECK(depth[Scheduler::HIGH_PRIORITY] == 10);
+    CHECK(depth[Scheduler::NORMAL_PRIORITY] == 100);
+    CHECK(depth[Scheduler::BACKGROUND_PRIORITY] == 100);
+    REQUIRE(order.size() == 210);
+
+    // high priority tasks jump the queue
+    int high_at = 0;
+    for (int i = 0; i < 210; ++i) {
+        if (order[i] == Scheduler::HIGH_PRIORITY) {
+            high_at = i;
+        }
+    }
+    CHECK(high_at < 20);
+    // background tasks get their share, 2 of every 14 picks
+    int background = std::count(order.begin(), order.begin() + 140, Scheduler::BACKGROUND_PRIORITY);
+    CHECK(background >= 15);
+    CHECK(sc.getQueueDepth(Scheduler::BACKGROUND_PRIORITY) == 0);
+}
+
+TEST_CASE("Test Work Stealing") {
+    eva01::Scheduler sc(4, "steal");
+    sc.start();
+
+    Mutex mtx;
+    std::set<pid_t> threads;
+    std::atomic<int> done { 0 };
+    sc.schedule([&]() {
+        // all land in the run queue of this worker, the others have to steal
+        for (int i = 0; i < 1000; ++i) {
+            Scheduler::GetThis()->schedule([&]() {
+                auto start = std::chrono::steady_clock::now();
+                while (std::chrono::steady_clock::now() - start < std::chrono::microseconds(100)) {
+                }
+                {
+                    MutexGuard<Mutex> lk(mtx);
+                    threads.insert(GetThreadId());
+                }
+                ++done;
+            });
+        }
+    });
+    sc.stop();
+
+    CHECK(done == 1000);
+    CHECK(threads.size() > 1);
+    EVA_LOG_INFO(logger) << "tasks ran on " << threads.size() << " threads";
+}
+
+TEST_CASE("Test Pinned Tasks") {
+    eva01::Scheduler sc(8, "pinned");
+    sc.start();
+    std::vector<pid_t> ids = sc.getThreadIds();
+    REQUIRE(ids.size() == 8);
+
+    std::atomic<int> done { 0 };
+    std::atomic<int> misplaced { 0 };
+    // every worker pins tasks to all the others, while outside tasks compete
+    for (size_t i = 0; i < ids.size(); ++i) {
+        sc.schedule([&]() {
+            for (int j = 0; j < 500; ++j) {
+                pid_t target = ids[j % ids.size()];
+                Scheduler::GetThis()->schedule([&, target]() {
+                    if (GetThreadId() != target) {
+                        ++misplaced;
+                    }
+                    ++done;
+                }, target);
+            }
+        }, ids[i]);
+    }
+    for (int i = 0; i < 1000; ++i) {
+        sc.schedule([&]() { ++done; });
+    }
+
+    // a pinned fiber stays on its thread across yields
+    Fiber::GetThis();
+    sc.schedule(Fiber::ptr(new Fiber([&]() {
+        for (int j = 0; j < 100; ++j) {
+            if (GetThreadId() != ids[3]) {
+                ++misplaced;
+            }
+            Fiber::YieldReady();
+        }
+        ++done;
+    })), ids[3]);
+    sc.stop();
+
+    CHECK(done == 8 * 500 + 1000 + 1);
+    CHECK(misplaced == 0);
+}
+
+TEST_CASE("Test Use Caller") {
+    pid_t self = GetThreadId();
+    eva01::Scheduler sc(1, "caller", true);
+    sc.start();
+    CHECK(sc.getThreadIds() == std::vector<pid_t>{ self });
+
+    // nothing runs before stop(), then everything on this thread
+    std::atomic<int> done { 0 };
+    std::atomic<int> elsewhere { 0 };
+    for (int i = 0; i < 100; ++i) {
+        sc.schedule([&]() {
+            if (GetThreadId() != self) {
+                ++elsewhere;
+            }
+            Fiber::YieldReady();
+            ++done;
+        });
+    }
+    usleep(10 * 1000);
+    CHECK(done == 0);
+    sc.stop();
+    CHECK(done == 100);
+    CHECK(elsewhere == 0);
+    CHECK(Scheduler::GetThis() == nullptr);
+
+    // with a spawned thread, driven until a task stops it
+    eva01::Scheduler sc2(2, "caller2", true);
+    for (int round = 0; round < 2; ++round) {
+        sc2.start();
+        std::atomic<int> count { 0 };
+        for (int i = 0; i < 1000; ++i) {
+            sc2.schedule([&]() {
+                if (++count == 1000) {
+                    Scheduler::GetThis()->stop();
+                }
+            });
+        }
+        // the spawned worker may take all of those, this one is ours
+        std::atomic<pid_t> pinned_on { 0 };
+        sc2.schedule([&]() { pinned_on = GetThreadId(); }, self);
+        sc2.runInCaller();
+        CHECK(count == 1000);
+        CHECK(pinned_on == self);
+    }
+}
+
+TEST_CASE("Test CPU Affinity") {
+    std::vector<int> allowed = Thread::GetAffinity();
+    REQUIRE(!allowed.empty());
+
+    // one CPU each, round-robin over the allowed ones
+    std::vector<std::vector<int>> sets;
+    for (int cpu : allowed) {
+        sets.push_back({ cpu });
+    }
+    eva01::Scheduler sc(2, "affinity");
+    sc.setCpuAffinity(sets);
+    sc.start();
+    std::vector<pid_t> ids = sc.getThreadIds();
+
+    std::vector<int> cpus[2];
+    for (int i = 0; i < 2; ++i) {
+        sc.schedule([&, i]() { cpus[i] = Thread::GetAffinity(); }, ids[i]);
+    }
+    sc.stop();
+
+    CHECK(cpus[0] == sets[0]);
+    CHECK(cpus[1] == sets[1 % sets.size()]);
+}
+
+TEST_CASE("Test Targeted Wakeup") {
+    eva01::Scheduler sc(8, "wakeup");
+    sc.start();
+    usleep(10 * 1000); // let all workers go idle
+
+    // One task at a time: each wakes a single worker, not all of them. A
+    // task that no wake-up announced would wait for the poller's epoll
+    // timeout, 200 of them would take minutes.
+    std::atomic<int> done { 0 };
+    for (int i = 0; i < 200; ++i) {
+        sc.schedule([&]() { ++done; });
+        while (done != i + 1) {
+        }
+    }
+    Scheduler::Stats stats = sc.getStats();
+    sc.stop();
+
+    CHECK(done == 200);
+    CHECK(stats.wakeups > 0);
+    CHECK(stats.wakeups <= stats.scheduled);
+    uint64_t tickles = 0;
+    for (auto& ws : stats.workers) {
+        tickles += ws.tickles;
+    }
+    CHECK(tickles == stats.wakeups); // each went to one worker
+    EVA_LOG_INFO(logger) << "wakeups=" << stats.wakeups << " scheduled=" << stats.scheduled;
+}
+
+TEST_CASE("Test Idle Spin") {
+    eva01::Scheduler sc(2, "spin");
+    sc.setIdlePolicy(2000, 1000);
+    sc.start();
+    usleep(10 * 1000);
+
+    // tasks arriving closer than the spin time find a worker still polling
+    std::atomic<int> done { 0 };
+    for (int i = 0; i < 100; ++i) {
+        sc.schedule([&]() { ++done; });
+        usleep(100);
+    }
+    uint64_t hits = sc.getSpinHits();
+    sc.stop();
+    CHECK(done == 100);
+    CHECK(hits > 0);
+
+    // adaptive: short gaps keep the spinning on, gaps longer than the spin
+    // time turn it off where a fixed policy spins in vain every time
+    auto gapped = [&](bool adaptive, uint64_t& short_hits) {
+        eva01::Scheduler sc2(1, adaptive ? "adaptive" : "fixed");
+        sc2.setIdlePolicy(2000, 0, adaptive);
+        CHECK(sc2.isAdaptiveSpin() == adaptive);
+        sc2.start();
+        usleep(10 * 1000);
+        done = 0;
+        for (int i = 0; i < 100; ++i) {
+            sc2.schedule([&]() { ++done; });
+            usleep(100);
+        }
+        short_hits = sc2.getSpinHits();
+        for (int i = 0; i < 30; ++i) {
+            sc2.schedule([&]() { ++done; });
+            usleep(5 * 1000);
+        }
+        // long settled by now
+        uint64_t misses = sc2.getSpinMisses();
+        for (int i = 0; i < 10; ++i) {
+            sc2.schedule([&]() { ++done; });
+            usleep(5 * 1000);
+        }
+        misses = sc2.getSpinMisses() - misses;
+        sc2.stop();
+        CHECK(done == 140);
+        return misses;
+    };
+    uint64_t fixed_hits = 0;
+    uint64_t adaptive_hits = 0;
+    uint64_t fixed_misses = gapped(false, fixed_hits);
+    uint64_t adaptive_misses = gapped(true, adaptive_hits);
+    EVA_LOG_INFO(logger) << "spin hits=" << hits << " short gap hits fixed=" << fixed_hits
+        << " adaptive=" << adaptive_hits << ", long gap misses fixed=" << fixed_misses
+        << " adaptive=" << adaptive_misses;
+    CHECK(adaptive_hits > 0);
+    CHECK(fixed_misses >= 5);
+    CHECK(adaptive_misses == 0);
+}
+
+TEST_CASE("Test Elastic Pool") {
+    eva01::Scheduler sc(1, "elastic");
+    sc.setElasticPool(1, 4, 10, 100);
+    sc.start();
+    CHECK(sc.getThreadCount() == 1);
+
+    // The latch is not hooked, the tasks hold their worker until it opens:
+    // the pool grows to the maximum and no further.
+    std::promise<void> open;
+    std::shared_future<void> latch = open.get_future().share();
+    std::atomic<int> done { 0 };
+    for (int i = 0; i < 16; ++i) {
+        sc.schedule([&]() {
+            latch.wait();
+            ++done;
+        });
+    }
+    auto start = std::chrono::steady_clock::now();
+    while (sc.getThreadCount() < 4 && std::chrono::steady_clock::now() - start < std::chrono::seconds(10)) {
+        usleep(1000);
+    }
+    CHECK(sc.getThreadCount() == 4);
+    CHECK(sc.getGrowCount() == 3);
+    CHECK(done == 0);
+    open.set_value();
+    while (done != 16 && std::chrono::steady_clock::now() - start < std::chrono::seconds(10)) {
+        usleep(1000);
+    }
+    CHECK(done == 16);
+    CHECK(sc.getGrowCount() == 3);
+
+    // back to the minimum once idle
+    start = std::chrono::steady_clock::now();
+    while (sc.getThreadCount() > 1 && std::chrono::steady_clock::now() - start < std::chrono::seconds(5)) {
+        usleep(10 * 1000);
+    }
+    CHECK(sc.getThreadCount() == 1);
+    CHECK(sc.getRetireCount() == sc.getGrowCount());
+    CHECK(sc.getThreadIds().size() == 1);
+
+    // still works after shrinking
+    std::atomic<bool> pinned { false };
+    sc.schedule([&]() { pinned = true; }, sc.getThreadIds()[0]);
+    sc.schedule([&]() { ++done; });
+    sc.stop();
+    CHECK(pinned);
+    CHECK(done == 17);
+    EVA_LOG_INFO(logger) << "grew=" << sc.getGrowCount() << " retired=" << sc.getRetireCount();
+}
+
+TEST_CASE("Test Elastic Pool keeps shared stack fibers") {
+    // A suspended shared stack fiber can only resume on the thread it ran
+    // on: a worker that has one must not retire.
+    eva01::Scheduler sc(1, "elastic_shared");
+    sc.setElasticPool(1, 4, 10, 100);
+    sc.start();
+    Fiber::GetThis();
+
+    std::atomic<int> done { 0 };
+    for (int i = 0; i < 4; ++i) {
+        sc.schedule([&]() { poll(nullptr, 0, 100); });
+    }
+    FiberSemaphore sem;
+    std::atomic<int> parked { 0 };
+    std::atomic<int> same_thread { 0 };
+    std::set<pid_t> homes;
+    Mutex homes_mutex;
+    for (int i = 0; i < 8; ++i) {
+        sc.schedule(Fiber::ptr(new Fiber([&]() {
+            pid_t home = GetThreadId();
+            {
+                MutexGuard<Mutex> lock(homes_mutex);
+                homes.insert(home);
+            }
+            ++parked;
+            sem.wait();
+            same_thread += GetThreadId() == home;
+            ++done;
+        }, 0, true)));
+    }
+    auto start = std::chrono::steady_clock::now();
+    while (parked != 8 && std::chrono::steady_clock::now() - start < std::chrono::seconds(5)) {
+        usleep(1000);
+    }
+    CHECK(parked == 8);
+    usleep(500 * 1000); // long enough to retire the idle workers
+    {
+        MutexGuard<Mutex> lock(homes_mutex);
+        CHECK(sc.getThreadCount() >= homes.size());
+        EVA_LOG_INFO(logger) << "homes=" << homes.size() << " threads=" << sc.getThreadCount()
+            << " grew=" << sc.getGrowCount() << " retired=" << sc.getRetireCount();
+    }
+    for (int i = 0; i < 8; ++i) {
+        sem.notify();
+    }
+    sc.stop();
+    CHECK(done == 8);
+    CHECK(same_thread == 8);
+}
+
+TEST_CASE("Test Offload") {
+    // One worker: a blocking call on it would hold up the other task.
+    eva01::Scheduler sc(1, "offload");
+    sc.setOffloadPool(2, 4);
+    sc.start();
+
+    std::atomic<bool> ticked { false };
+    std::atomic<bool> ticked_during { false };
+    std::atomic<bool> same_scheduler { false };
+    std::atomic<int> result { 0 };
+    std::atomic<bool> caught { false };
+    sc.schedule([&]() {
+        result = sc.offload([&]() {
+            poll(nullptr, 0, 100);
+            ticked_during = (bool)ticked;
+            return 42;
+        });
+        same_scheduler = eva01::Scheduler::GetThis() == &sc;
+        try {
+            sc.offload([]() { throw std::runtime_error("boom"); });
+        } catch (const std::runtime_error& e) {
+            caught = std::string(e.what()) == "boom";
+        }
+    });
+    sc.schedule([&]() { ticked = true; });
+
+    // stop() waits for offloaded calls
+    std::atomic<int> files { 0 };
+    for (int i = 0; i < 8; ++i) {
+        sc.schedule([&]() {
+            sc.offload([&]() {
+                poll(nullptr, 0, 10);
+                ++files;
+            });
+        });
+    }
+    sc.stop();
+    CHECK(ticked_during);
+    CHECK(same_scheduler);
+    CHECK(result == 42);
+    CHECK(caught);
+    CHECK(files == 8);
+}
+
+TEST_CASE("Test Time Slice") {
+    eva01::Scheduler sc(1, "slice");
+    sc.setTimeSlice(10);
+    sc.start();
+
+    // a CPU loop with safe points lets the other task in
+    std::atomic<bool> other { false };
+    std::atomic<bool> other_during { false };
+    int yields = 0;
+    sc.schedule([&]() {
+        auto end = std::chrono::steady_clock::now() + std::chrono::milliseconds(200);
+        while (std::chrono::steady_clock::now() < end) {
+            yields += eva01::Fiber::MaybeYield();
+        }
+        other_during = (bool)other;
+    });
+    sc.schedule([&]() { other = true; });
+    sc.stop();
+
+    CHECK(other_during);
+#ifdef EVA01_PREEMPT_INSTRUMENT
+    // instrumented, the function entries of the loop may take the requests
+    CHECK(sc.getPreemptCount() > 0);
+    CHECK(sc.getPreemptCount() >= (uint64_t)yields);
+#else
+    CHECK(yields > 0);
+    CHECK(sc.getPreemptCount() == (uint64_t)yields);
+#endif
+    CHECK(sc.getPreemptRequests() >= sc.getPreemptCount());
+    EVA_LOG_INFO(logger) << "requests=" << sc.getPreemptRequests() << " yields=" << yields;
+    // outside of a worker it is only a flag test
+    CHECK(!eva01::Fiber::MaybeYield());
+}
+
+TEST_CASE("Test Dequeue Batch") {
+    for (size_t batch : { 1, 16 }) {
+        eva01::Scheduler sc(2, "batch");
+        sc.setDequeueBatch(batch);
+        sc.start();
+
+        std::atomic<int> done { 0 };
+        std::vector<std::function<void()>> tasks(1000, [&]() { ++done; });
+        sc.schedule(tasks.begin(), tasks.end()); // all in the inject queue
+        std::atomic<bool> pinned { false };
+        pid_t thread = sc.getThreadIds()[0];
+        sc.schedule([&]() { pinned = eva01::GetThreadId() == thread; }, thread);
+        sc.stop();
+
+        CHECK(done == 1000);
+        CHECK(pinned);
+        CHECK(sc.getBatchedTasks() >= 1000);
+        if (batch == 1) {
+            CHECK(sc.getBatchCount() == sc.getBatchedTasks());
+        } else {
+            // fewer lock round trips than tasks
+            CHECK(sc.getBatchCount() < sc.getBatchedTasks() / 2);
+        }
+        EVA_LOG_INFO(logger) << "batch=" << batch << " batches=" << sc.getBatchCount()
+            << " tasks=" << sc.getBatchedTasks();
+    }
+}
+
+TEST_CASE("Test Bounded Queue") {
+    // One worker held up by a task, so the others stay queued.
+    auto plug = [](eva01::Scheduler& sc, std::atomic<bool>& go) {
+        sc.schedule([&go]() {
+            while (!go) {
+                poll(nullptr, 0, 1);
+            }
+        });
+        while (sc.getQueueDepth(eva01::Scheduler::NORMAL_PRIORITY)) {
+            poll(nullptr, 0, 1);
+        }
+    };
+
+    SUBCASE("reject") {
+        eva01::Scheduler sc(1, "bounded");
+        sc.setQueueCapacity(4, eva01::Scheduler::REJECT_WHEN_FULL);
+        sc.start();
+        std::atomic<bool> go { false };
+        plug(sc, go);
+
+        std::atomic<int> done { 0 };
+        for (int i = 0; i < 4; ++i) {
+            CHECK(sc.schedule([&]() { ++done; }));
+        }
+        CHECK_FALSE(sc.schedule([&]() { ++done; }));
+        CHECK_THROWS_AS(sc.async([]() { return 1; }).get(), eva01::TaskRejected);
+        // work already taken on gets in
+        std::atomic<bool> high { false };
+        CHECK(sc.schedule([&]() { high = true; }, eva01::Scheduler::HIGH_PRIORITY));
+        go = true;
+        sc.stop();
+        CHECK(done == 4);
+        CHECK(high);
+        CHECK(sc.getRejectedCount() == 2);
+    }
+
+    SUBCASE("drop oldest") {
+        eva01::Scheduler sc(1, "bounded");
+        sc.setQueueCapacity(4, eva01::Scheduler::DROP_OLDEST);
+        sc.start();
+        std::atomic<bool> go { false };
+        plug(sc, go);
+
+        std::vector<eva01::Future<int>> futures;
+        for (int i = 0; i < 6; ++i) {
+            futures.push_back(sc.async([i]() { return i; }));
+        }
+        CHECK(sc.getDroppedCount() == 2);
+        CHECK_THROWS_AS(futures[0].get(), std::future_error);
+        CHECK_THROWS_AS(futures[1].get(), std::future_error);
+        go = true;
+        for (int i = 2; i < 6; ++i) {
+            CHECK(futures[i].get() == i);
+        }
+        sc.stop();
+    }
+
+    SUBCASE("block") {
+        eva01::Scheduler sc(1, "bounded");
+        sc.setQueueCapacity(2);
+        sc.start();
+        std::atomic<bool> go { false };
+        plug(sc, go);
+
+        std::atomic<int> done { 0 };
+        sc.schedule([&]() { ++done; });
+        sc.schedule([&]() { ++done; });
+        std::atomic<bool> queued { false };
+        Thread producer([&]() {
+            sc.schedule([&]() { ++done; });
+            queued = true;
+        }, "producer");
+        poll(nullptr, 0, 50);
+        CHECK_FALSE(queued); // waits for room
+        go = true;
+        producer.join();
+        sc.stop();
+        CHECK(queued);
+        CHECK(done == 3);
+        CHECK(sc.getBlockedCount() == 1);
+    }
+
+    SUBCASE("shed") {
+        eva01::Scheduler sc(1, "bounded");
+        sc.setSojournTarget(2, 20);
+        sc.start();
+
+        std::atomic<int> done { 0 };
+        for (int i = 0; i < 40; ++i) {
+            sc.schedule([&]() {
+                poll(nullptr, 0, 5);
+                ++done;
+            });
+        }
+        for (int i = 0; i < 400 && !sc.isOverloaded(); ++i) {
+            poll(nullptr, 0, 1);
+        }
+        CHECK(sc.isOverloaded());
+        CHECK_FALSE(sc.schedule([&]() { ++done; }));
+        CHECK(sc.getShedCount() == 1);
+        sc.stop();
+        CHECK(done == 40);
+        CHECK_FALSE(sc.isOverloaded()); // the queues ran empty
+    }
+}
+
+TEST_CASE("Test Stats") {
+    eva01::Histogram h;
+    for (uint64_t v : { 0, 1, 3, 100, 100, 5000 }) {
+        h.counts[eva01::Histogram::Bucket(v)]++;
+    }
+    CHECK(h.count() == 6);
+    CHECK(h.percentile(0) == 0);
+    CHECK(h.percentile(0.5) == 3);
+    CHECK(h.percentile(0.6) == 127);  // 100 is in [64, 128)
+    CHECK(h.percentile(1) == 8191);
+
+    eva01::Scheduler sc(2, "stats");
+    sc.setStatsEnabled(true);
+    CHECK(sc.getStats().workers.empty());
+    sc.start();
+
+    std::atomic<int> done { 0 };
+    for (int i = 0; i < 100; ++i) {
+        sc.schedule([&]() {
+            Fiber::YieldReady();
+            poll(nullptr, 0, 0);
+            ++done;
+        });
+    }
+    while (done < 100) {
+        poll(nullptr, 0, 1);
+    }
+    poll(nullptr, 0, 20); // all back in idle
+
+    // read while running
+    eva01::Scheduler::Stats stats = sc.getStats();
+    REQUIRE(stats.workers.size() == 2);
+    uint64_t tasks = 0;
+    uint64_t resumed = 0;
+    for (auto& ws : stats.workers) {
+        CHECK(ws.thread_id != 0);
+        CHECK(ws.idle_us > 0); // idle right now
+        tasks += ws.tasks_run;
+        resumed += ws.fibers_resumed;
+    }
+    CHECK(tasks == 100);
+    CHECK(resumed == 100); // after the yield
+    CHECK(stats.scheduled >= 200);
+    CHECK(stats.queue_depth[eva01::Scheduler::NORMAL_PRIORITY] == 0);
+    CHECK(stats.wait_us.count() == 200);
+    CHECK(stats.run_us.count() == 200);
+    EVA_LOG_INFO(logger) << "wait p50=" << stats.wait_us.percentile(0.5)
+        << "us p99=" << stats.wait_us.percentile(0.99)
+        << "us run p50=" << stats.run_us.percentile(0.5) << "us";
+    sc.stop();
+}
+
+TEST_CASE("Test Stop Deadline") {
+    SUBCASE("cancel timers") {
+        eva01::Scheduler sc(2, "deadline");
+        sc.start();
+        std::atomic<int> ticks { 0 };
+        sc.addTimer(10, [&]() { ++ticks; }, true); // stop() would wait forever
+        poll(nullptr, 0, 30);
+        eva01::Scheduler::StopReport report = sc.stop(1000);
+        CHECK(report.drained);
+        CHECK(report.timers == 1);
+        CHECK(report.dropped_tasks == 0);
+        CHECK(report.elapsed_ms < 500); // nobody waits for an epoll timeout
+        CHECK_FALSE(sc.hasTimers());
+    }
+
+    SUBCASE("fire timers") {
+        eva01::Scheduler sc(2, "deadline");
+        sc.start();
+        std::atomic<int> fired { 0 };
+        sc.addTimer(10000, [&]() { ++fired; });
+        eva01::Scheduler::StopReport report = sc.stop(1000, eva01::Scheduler::FIRE_TIMERS);
+        CHECK(report.drained);
+        CHECK(report.timers == 1);
+        CHECK(fired == 1);
+    }
+
+    SUBCASE("deadline") {
+        eva01::Scheduler sc(1, "deadline");
+        sc.start();
+        std::atomic<bool> refused { false };
+        sc.schedule([&]() {
+            while (true) { // until it is told to yield
+                poll(nullptr, 0, 1);
+                if (!refused && !Scheduler::GetThis()->schedule([]() {})) {
+                    refused = true; // closed for new tasks
+                }
+                Fiber::MaybeYield();
+            }
+        });
+        std::vector<eva01::Future<int>> futures;
+        for (int i = 0; i < 10; ++i) {
+            futures.push_back(sc.async([i]() { return i; }));
+        }
+        sc.addTimer(10, []() {}, true);
+        eva01::Scheduler::StopReport report = sc.stop(100, eva01::Scheduler::WAIT_TIMERS);
+        CHECK_FALSE(report.drained);
+        CHECK(refused);
+        CHECK(report.elapsed_ms >= 100);
+        CHECK(report.elapsed_ms < 1000);
+        CHECK(report.dropped_tasks >= 10);
+        CHECK(report.dropped_timers == 1);
+        for (auto& f : futures) {
+            CHECK_THROWS_AS(f.get(), std::future_error);
+        }
+
+        // and starts over
+        sc.start();
+        std::atomic<bool> ran { false };
+        CHECK(sc.schedule([&]() { ran = true; }));
+        sc.stop();
+        CHECK(ran);
+    }
+
+    SUBCASE("offload") {
+        eva01::Scheduler sc(1, "deadline");
+        sc.setOffloadPool(1);
+        sc.start();
+        std::atomic<bool> started { false };
+        std::atomic<bool> resumed { false };
+        sc.schedule([&]() {
+            Scheduler::GetThis()->offload([&]() {
+                started = true;
+                poll(nullptr, 0, 300);
+            });
+            resumed = true;
+        });
+        while (!started) {
+            poll(nullptr, 0, 1);
+        }
+        // waits for the job, drops the fiber it wakes
+        eva01::Scheduler::StopReport report = sc.stop(50);
+        CHECK_FALSE(report.drained);
+        CHECK(report.dropped_tasks == 1);
+        CHECK_FALSE(resumed);
+        for (int prio = 0; prio < eva01::Scheduler::PRIORITY_COUNT; ++prio) {
+            CHECK(sc.getQueueDepth((eva01::Scheduler::Priority)prio) == 0);
+        }
+
+        // nobody is counted as waiting any more
+        sc.start();
+        std::atomic<bool> ran { false };
+        CHECK(sc.schedule([&]() { ran = true; }));
+        sc.stop();
+        CHECK(ran);
+    }
+}
+
 TEST_CASE("Test Timer") {
     eva01::Scheduler sc;
     sc.start();
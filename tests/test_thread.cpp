@@ -23,3 +23,21 @@ TEST_CASE("Test Thread") {
     CHECK(flag);
 }
 
+
+TEST_CASE("Test Thread Affinity") {
+    std::vector<int> allowed = eva01::Thread::GetAffinity();
+    REQUIRE(!allowed.empty());
+    int cpu = allowed.back();
+
+    std::vector<int> pinned;
+    int ran_on = -1;
+    eva01::Thread::ptr thr = std::make_shared<eva01::Thread>([&]{
+            pinned = eva01::Thread::GetAffinity();
+            ran_on = eva01::Thread::GetCpu();
+            }, "pinned", std::vector<int>{ cpu });
+    thr->join();
+
+    CHECK(pinned == std::vector<int>{ cpu });
+    CHECK(ran_on == cpu);
+    CHECK(eva01::Thread::GetNumaNode() >= 0);
+}